@@ -0,0 +1,248 @@
+/*
+ *
+ * Copyright (c) 2003 The Regents of the University of California.  All 
+ * rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * - Neither the name of the University nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+ 
+ 
+
+/*
+ * FUSD - The Framework for UserSpace Devices - Example program
+ *
+ * epoll-herd.c: how many epoll waiters wake up per event.  This forks
+ * a driver that makes its files readable whenever someone writes to
+ * the device, until the byte written has been read back.  The client
+ * forks N waiters sharing one open file, each with its own epoll set
+ * holding it with EPOLLIN|EPOLLEXCLUSIVE, then writes one byte at a
+ * time (from another open file), waiting each time for a waiter to
+ * have read it.  Every epoll_wait that returns counts as a wakeup;
+ * ideally there is one per event, the waiter that reads the byte.
+ *
+ * Usage: epoll-herd [-s] [waiters [events]]
+ *    -s leaves out EPOLLEXCLUSIVE, to see the herd for comparison.
+ *
+ * Run it against kfusd builds from before and after a change to
+ * compare wakeups per event.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "fusd.h"
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1U << 28)
+#endif
+
+#define DEF_WAITERS 16
+#define DEF_EVENTS  2000
+#define EVENT_WAIT  2000	/* ms to wait for an event to be read */
+
+
+/* shared by the client and its waiters */
+struct herd_counts {
+  volatile int stop;
+  int wakeups;			/* epoll_waits that returned an event */
+  int consumed;			/* of which read a byte */
+};
+
+/* the driver's registration, and bytes written but not yet read */
+static int herd_fd;
+static int pending = 0;
+
+int zeroreturn(struct fusd_file_info *file) { return 0; }
+
+/* This function is run by the driver: every byte written is an event,
+ * and makes every file readable */
+ssize_t herd_write(struct fusd_file_info *file, const char *buffer,
+                   size_t length, loff_t *offset)
+{
+  pending += length;
+  fusd_broadcast_readiness(herd_fd, 0, FUSD_NOTIFY_INPUT, 0);
+  return length;
+}
+
+/* This function is run by the driver: hands out one event.  Readiness
+ * is cleared before the read returns, so the waiters that lost the
+ * race see it gone when they go back to epoll_wait */
+ssize_t herd_read(struct fusd_file_info *file, char *buffer, size_t length,
+                  loff_t *offset)
+{
+  if (pending == 0)
+    return -EAGAIN;
+
+  pending--;
+  if (pending == 0)
+    fusd_broadcast_readiness(herd_fd, 0, 0, FUSD_NOTIFY_INPUT);
+  buffer[0] = 'x';
+  return 1;
+}
+
+static void run_waiter(int fd, unsigned int events, struct herd_counts *counts)
+{
+  struct epoll_event ev;
+  char c;
+  int ep;
+
+  if ((ep = epoll_create1(0)) < 0) {
+    perror("waiter: epoll_create1");
+    _exit(1);
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("waiter: epoll_ctl");
+    _exit(1);
+  }
+
+  while (!counts->stop) {
+    if (epoll_wait(ep, &ev, 1, 100) <= 0)
+      continue;
+    __sync_fetch_and_add(&counts->wakeups, 1);
+    if (read(fd, &c, 1) == 1)
+      __sync_fetch_and_add(&counts->consumed, 1);
+  }
+  _exit(0);
+}
+
+static int run_client(int waiters, int events, int exclusive)
+{
+  struct herd_counts *counts;
+  struct timespec start, end;
+  pid_t *pids;
+  int fd, trigger, i, waited, lost = 0;
+  double secs;
+
+  counts = mmap(NULL, sizeof(*counts), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (counts == MAP_FAILED || (pids = calloc(waiters, sizeof(pid_t))) == NULL) {
+    perror("client: out of memory");
+    return 1;
+  }
+  memset(counts, 0, sizeof(*counts));
+
+  if ((fd = open("/dev/herdtest", O_RDONLY | O_NONBLOCK)) < 0 ||
+      (trigger = open("/dev/herdtest", O_WRONLY)) < 0) {
+    perror("client: can't open /dev/herdtest");
+    return 1;
+  }
+
+  for (i = 0; i < waiters; i++) {
+    if ((pids[i] = fork()) < 0) {
+      perror("client: can't fork waiter");
+      return 1;
+    }
+    if (pids[i] == 0)
+      run_waiter(fd, EPOLLIN | (exclusive ? EPOLLEXCLUSIVE : 0), counts);
+  }
+  sleep(1);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < events; i++) {
+    if (write(trigger, "x", 1) != 1) {
+      perror("client: write");
+      break;
+    }
+    /* in steps of 100us */
+    for (waited = 0; counts->consumed + lost <= i && waited < EVENT_WAIT * 10; waited++)
+      usleep(100);
+    if (counts->consumed + lost <= i)
+      lost++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  counts->stop = 1;
+  for (i = 0; i < waiters; i++)
+    waitpid(pids[i], NULL, 0);
+
+  printf("client: %d %s waiters, %d events in %.2fs: %d wakeups, %.2f per event",
+         waiters, exclusive ? "EPOLLEXCLUSIVE" : "shared", events, secs,
+         counts->wakeups, events ? (double) counts->wakeups / events : 0.0);
+  if (lost)
+    printf(", %d events never read", lost);
+  printf("\n");
+
+  close(trigger);
+  close(fd);
+  free(pids);
+  return lost != 0;
+}
+
+int main(int argc, char *argv[])
+{
+  pid_t server_pid;
+  int ret, exclusive = 1, waiters = DEF_WAITERS, events = DEF_EVENTS;
+
+  if (argc > 1 && !strcmp(argv[1], "-s")) {
+    exclusive = 0;
+    argc--;
+    argv++;
+  }
+  if (argc > 1)
+    waiters = atoi(argv[1]);
+  if (argc > 2)
+    events = atoi(argv[2]);
+  if (waiters <= 0 || events <= 0) {
+    fprintf(stderr, "usage: epoll-herd [-s] [waiters [events]]\n");
+    exit(1);
+  }
+
+  if ((server_pid = fork()) < 0) {
+    perror("error creating server");
+    exit(1);
+  }
+
+  if (server_pid == 0) {
+    struct fusd_file_operations f = {
+      open: zeroreturn,
+      close: zeroreturn,
+      read: herd_read,
+      write: herd_write };
+
+    if ((herd_fd = fusd_register("/dev/herdtest", "misc", "herdtest", 0666, NULL, &f)) < 0)
+      perror("registering herdtest");
+    fusd_run();
+    exit(0);
+  }
+
+  sleep(1);
+  ret = run_client(waiters, events, exclusive);
+
+  kill(server_pid, SIGTERM);
+  waitpid(server_pid, NULL, 0);
+  return ret;
+}
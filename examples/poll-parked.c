@@ -0,0 +1,166 @@
+/*
+ *
+ * Copyright (c) 2003 The Regents of the University of California.  All 
+ * rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * - Neither the name of the University nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+ 
+ 
+
+/*
+ * FUSD - The Framework for UserSpace Devices - Example program
+ *
+ * poll-parked.c: poll() on a file with a read parked in the driver.
+ * This forks a driver whose read callback never answers (it returns
+ * -FUSD_NOREPLY and sits on the request) and whose files are always
+ * writable.  The client parks a read on its file from a child, then
+ * polls the same file for POLLOUT: that must come back right away,
+ * not when (or if) the driver gets around to the read.
+ *
+ * Exits 0 if it does, 1 if poll() blocked or didn't say writable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "fusd.h"
+
+#define POLL_TIMEOUT 5000	/* ms poll() may take before we call it stuck */
+#define POLL_FAST    500	/* ms it should take at most */
+
+
+/* the read we're sitting on, and the polldiff request we hold on to
+ * until the state changes (it never does) */
+static struct fusd_file_info *parked = NULL;
+static struct fusd_file_info *polldiff = NULL;
+
+int zeroreturn(struct fusd_file_info *file) { return 0; }
+
+/* This function is run by the driver */
+ssize_t park_read(struct fusd_file_info *file, char *buffer, size_t length,
+                  loff_t *offset)
+{
+  if (parked != NULL)
+    fusd_destroy(parked);
+  parked = file;
+  return -FUSD_NOREPLY;
+}
+
+/* This function is run by the driver: files are always writable,
+ * never readable */
+int park_polldiff(struct fusd_file_info *file, unsigned int cached_state)
+{
+  if (cached_state != FUSD_NOTIFY_OUTPUT)
+    return FUSD_NOTIFY_OUTPUT;
+
+  if (polldiff != NULL)
+    fusd_destroy(polldiff);
+  polldiff = file;
+  return -FUSD_NOREPLY;
+}
+
+static int run_client(void)
+{
+  struct pollfd pfd;
+  struct timespec start, end;
+  pid_t reader;
+  char c;
+  int fd, ret, ms, failed;
+
+  if ((fd = open("/dev/polltest", O_RDWR)) < 0) {
+    perror("client: can't open /dev/polltest");
+    return 1;
+  }
+
+  /* the child shares the open file, and parks a read on it */
+  if ((reader = fork()) < 0) {
+    perror("client: can't fork reader");
+    return 1;
+  }
+  if (reader == 0) {
+    read(fd, &c, 1);
+    _exit(0);
+  }
+  sleep(1);
+
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ret = poll(&pfd, 1, POLL_TIMEOUT);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+  if (ret < 0)
+    perror("client: poll");
+  failed = ret != 1 || !(pfd.revents & POLLOUT) || ms > POLL_FAST;
+  printf("client: poll with a parked read returned %d (revents 0x%x) after %dms: %s\n",
+         ret, pfd.revents, ms, failed ? "FAILED" : "ok");
+
+  kill(reader, SIGKILL);
+  waitpid(reader, NULL, 0);
+  close(fd);
+  return failed;
+}
+
+int main(int argc, char *argv[])
+{
+  pid_t server_pid;
+  int ret;
+
+  if ((server_pid = fork()) < 0) {
+    perror("error creating server");
+    exit(1);
+  }
+
+  if (server_pid == 0) {
+    struct fusd_file_operations f = {
+      open: zeroreturn,
+      close: zeroreturn,
+      read: park_read,
+      poll_diff: park_polldiff };
+
+    if (fusd_register("/dev/polltest", "misc", "polltest", 0666, NULL, &f) < 0)
+      perror("registering polltest");
+    fusd_run();
+    exit(0);
+  }
+
+  sleep(1);
+  ret = run_client();
+
+  kill(server_pid, SIGTERM);
+  waitpid(server_pid, NULL, 0);
+  return ret;
+}
@@ -56,6 +56,20 @@ __BEGIN_DECLS
  * fusd_return() function.  */
 #define FUSD_NOREPLY  0x1000
 
+/* The munmap callback is called once a client's mmap, answered with
+ * a buffer (addr) of yours, is gone for good: unmapped, by every
+ * process it was shared with, and all of it.  offset and length are
+ * those your mmap callback was called with.  The buffer is yours to
+ * reuse or free from then on.  Nothing is waiting for an answer, so
+ * the return value is ignored; and mmaps answered with fusd_mmap_fd
+ * aren't reported, since the file's pages go away by themselves. */
+
+/* Clients may also send a batch of reads and ioctls in one go
+ * (FUSD_IOC_BATCH, see fusd_client.h).  They reach your read and ioctl
+ * callbacks one after the other, as usual, except that those can't put
+ * off their reply: an op whose callback returns -FUSD_NOREPLY fails
+ * with EAGAIN (the eventual fusd_return just frees the file). */
+
 /* FUSD defines several bitmasks for describing which channels of  
  * notification are being requested or signaled.  These flags are
  * used in the arguments and return value of the notify() callback. */
@@ -82,6 +96,9 @@ struct fusd_file_operations {
   int (*poll_diff) (struct fusd_file_info *file, unsigned int cached_state);
   int (*unblock) (struct fusd_file_info *file);
   int (*mmap) (struct fusd_file_info *file, int offset, size_t length, int prot, int flags, void** addr, size_t* out_length);
+  int (*stream_low) (struct fusd_file_info *file, size_t room);
+  int (*fault) (struct fusd_file_info *file, off_t offset, size_t length, int prot);
+  int (*munmap) (struct fusd_file_info *file, int offset, size_t length, void *addr);
 } fusd_file_operations_t;
 
 
@@ -138,7 +155,10 @@ struct fusd_file_info {
  *    value has no effect on FUSD itself.
  *
  *    fops - a table of callbacks to be called for this device; see
- *    structure above.
+ *    structure above.  Leave a callback NULL if you don't need it:
+ *    the kernel then handles that operation itself.  opens and
+ *    closes succeed, polls never report readiness, and other calls
+ *    fail with -ENOSYS, all without waking the driver up.
  *
  * Return value:
  *    On failure, -1 is returned and errno is set to indicate the error.
@@ -174,6 +194,384 @@ int fusd_register(const char *name, const char* clazz, const char* devname, mode
 int fusd_unregister(int fd);
 
 
+/* fusd_set_ioctl_ranges: restrict the ioctls forwarded to a device
+ *
+ * By default every ioctl on a device is passed to the driver's ioctl
+ * callback.  A driver that only understands a few request numbers can
+ * declare them here; the kernel then fails all others with -ENOTTY
+ * without a round trip.  (Drivers with no ioctl callback at all get
+ * this for free: the kernel fails every ioctl with -ENOSYS.)
+ *
+ * Arguments:
+ *    fd - the file descriptor previously returned by fusd_register.
+ *    ranges - array of inclusive [first, last] request number ranges
+ *    count - number of entries in ranges, at most
+ *            FUSD_MAX_IOCTL_RANGES.  0 accepts every ioctl again.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure.
+ */
+int fusd_set_ioctl_ranges(int fd, const fusd_ioctl_range_t *ranges, int count);
+
+
+/* fusd_set_device_flags: change how the kernel handles a device
+ *
+ * Arguments:
+ *    fd - the file descriptor previously returned by fusd_register.
+ *    set - FUSD_DEV_* flags to turn on
+ *    clear - FUSD_DEV_* flags to turn off
+ *
+ * Flags:
+ *    FUSD_DEV_ASYNC_CLOSE - a client's close() returns as soon as the
+ *    close request is queued for the driver, instead of waiting for
+ *    the close callback to run.  The callback's return value is
+ *    discarded.
+ *
+ *    FUSD_DEV_NONBLOCK_CACHED - reads (writes) on O_NONBLOCK files
+ *    fail with EAGAIN right away, without calling the driver, while
+ *    the file is not known to be readable (writable).  Readiness
+ *    comes from poll_diff replies, which the kernel then requests on
+ *    its own, or from fusd_set_readiness; push it in your open
+ *    callback, since files start out neither readable nor writable.
+ *
+ *    FUSD_DEV_PAGE_CACHE - the kernel keeps the data your read
+ *    callback returns, by offset, and serves later reads of the same
+ *    range itself.  For static, random-access content only: reads
+ *    become page-aligned and may be larger than the client's, and a
+ *    read returning less than asked for is taken to mean end of file.
+ *    Call fusd_invalidate_cache when the content changes; client
+ *    writes invalidate what they overwrite.  Clearing the flag drops
+ *    the cache.
+ *
+ *    FUSD_DEV_WRITE_BEHIND - client writes return as soon as the
+ *    kernel has buffered them.  Your write callback gets them later,
+ *    batched up, in order and with the offsets they were written at;
+ *    write all of it, since an error or short write can only be
+ *    reported to the client's next write or fsync.  fsync and close
+ *    wait until you've returned every write, and so does every other
+ *    call on the file (ioctl, batch, mmap) before it reaches you; an
+ *    error is reported to that call instead.  Reads wait too, but
+ *    leave the error for the next write.
+ *
+ *    FUSD_DEV_COALESCE - write-behind, for clients making lots of tiny
+ *    writes.  Writes made while the previous one hasn't reached you
+ *    yet are merged into it, and a small write is held back for a
+ *    moment in case more follow (see fusd_set_coalesce_delay).
+ *
+ *    FUSD_DEV_STREAM - your read callback is never called: clients
+ *    read, and poll, the data you push with fusd_stream_push, like
+ *    a pipe.  The stream_low callback, if you have one, is called
+ *    when a file's ring is running low, with how much room it has;
+ *    it's not a request, so return whatever you like.
+ *
+ *    FUSD_DEV_MMAP_POPULATE - a client's mmap maps in all of the
+ *    buffer your mmap callback returns right away, rather than page
+ *    by page (or rather a few pages, or a huge page, at a time) as
+ *    the client touches it.  All of it must exist by then.
+ *
+ *    FUSD_DEV_MMAP_FAULT - for mmaps you answer with fusd_mmap_fd:
+ *    the file may start out empty (sparse), and your fault callback
+ *    is asked to fill it in as clients touch it.  offset and length
+ *    are a range of the file, the page touched and the missing ones
+ *    after it (up to 16 pages); prot is PROT_READ, or'd with
+ *    PROT_WRITE if the client was writing.  Write the data into the
+ *    file (at least the first page) and return 0; a page you don't
+ *    fill reads as zeros, and an error raises SIGBUS in the client.
+ *
+ *    FUSD_DEV_MMAP_MKWRITE - with FUSD_DEV_MMAP_FAULT, your fault
+ *    callback is also told, with prot PROT_WRITE alone, before the
+ *    first write to each page of a shared mapping, e.g. to note it
+ *    dirty.  The write waits for your answer; an error refuses it
+ *    with SIGBUS.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure (EINVAL if
+ *    set or clear has a bit this kernel module doesn't know).
+ */
+int fusd_set_device_flags(int fd, unsigned int set, unsigned int clear);
+
+
+/* fusd_set_open_policy: let the kernel decide opens by itself
+ *
+ * Many drivers only look at the caller's uid or gid in their open
+ * callback.  Installing an equivalent policy spares them a round
+ * trip for every open.
+ *
+ * Arguments:
+ *    fd - the file descriptor previously returned by fusd_register.
+ *    flags - FUSD_POLICY_* flags:
+ *       FUSD_POLICY_FINAL - callers in the uid or gid sets are let in
+ *       without calling open (nor, later, close).  Without it, the
+ *       sets only filter who gets to the open callback.
+ *       FUSD_POLICY_CACHE - remember, per uid and access mode
+ *       (O_RDONLY, O_WRONLY or O_RDWR), whether the open callback
+ *       accepted (0) or refused (-EPERM/-EACCES) the caller, and give
+ *       later opens by that uid in that mode the same answer, without
+ *       calling open or close.  Only use this if your open callback
+ *       keeps no per-file state, and looks at no other open flags.
+ *    cache_ttl - milliseconds a cached answer stays valid; 0 keeps it
+ *    until fusd_flush_open_cache.
+ *    uids, num_uids - users allowed to open the device
+ *    gids, num_gids - groups allowed to open the device
+ *
+ *    If both sets are empty, nobody is refused by the kernel.  Passing
+ *    no flags and empty sets removes the policy.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure.
+ */
+int fusd_set_open_policy(int fd, unsigned int flags, unsigned int cache_ttl,
+                         const uid_t *uids, int num_uids,
+                         const gid_t *gids, int num_gids);
+
+/* fusd_flush_open_cache: forget the cached open answer for a uid, or
+ * for every uid if uid is (uid_t) -1.  Call this when whatever your
+ * open callback checks has changed. */
+int fusd_flush_open_cache(int fd, uid_t uid);
+
+
+/* fusd_set_readiness: tell the kernel what a client would currently
+ * get from select() or poll() on one of your files
+ *
+ * This replaces the poll_diff callback: instead of holding on to a
+ * poll_diff request per client and completing it when things change,
+ * call this whenever a file becomes (or stops being) readable or
+ * writable.  Polling clients then never wait on the driver.  Drivers
+ * that use it should not register a poll_diff callback; the kernel
+ * then also stops assuming a read or write consumed the readiness.
+ *
+ * Arguments:
+ *    fd - the file descriptor previously returned by fusd_register.
+ *    file_id - the value of fusd_get_file_id() for the file, saved
+ *    from any callback on it (typically open).
+ *    state - the FUSD_NOTIFY_* bits that are now true.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure (EPIPE if
+ *    the file has been closed in the meantime).
+ */
+int fusd_set_readiness(int fd, void *file_id, unsigned int state);
+
+
+/* fusd_set_file_meta: publish metadata the kernel can answer client
+ * queries with, instead of calling the driver
+ *
+ * Arguments:
+ *    fd - the file descriptor previously returned by fusd_register.
+ *    file_id - the value of fusd_get_file_id() for the file, or NULL
+ *    to update every file currently open on the device.
+ *    meta - the fields named in meta->valid are updated (may be NULL):
+ *       FUSD_META_AVAIL - meta->avail bytes can be read.  FIONREAD is
+ *       answered with it, and reads subtract what they return.
+ *       FUSD_META_SIZE - the file is meta->size bytes long: lseek
+ *       with SEEK_END works.  This is per open file, so fstat (which
+ *       describes the device node) doesn't report it.
+ *       FUSD_META_SEEKABLE - lseek fails with ESPIPE if
+ *       meta->seekable is 0.
+ *    forget - FUSD_META_* fields the kernel should stop answering for.
+ *
+ * lseek is always handled by the kernel; the resulting position is
+ * what your read and write callbacks get as their offset.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure.
+ */
+int fusd_set_file_meta(int fd, void *file_id, const fusd_file_meta_t *meta,
+                       unsigned int forget);
+
+
+/* fusd_invalidate_cache: drop the data cached for a byte range of a
+ * FUSD_DEV_PAGE_CACHE device (to its end if length is 0; pass 0, 0 to
+ * drop everything).  Later reads of the range go to your read callback.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure.
+ */
+int fusd_invalidate_cache(int fd, long long offset, long long length);
+
+
+/* fusd_set_coalesce_delay: how long (in microseconds, 1000 by
+ * default, at most a second) the kernel may hold back a small write to
+ * a FUSD_DEV_COALESCE device, waiting for more to merge it with.  0
+ * sends each one right away, unless the previous one is still queued.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure.
+ */
+int fusd_set_coalesce_delay(int fd, unsigned int usecs);
+
+
+/* fusd_cache_ioctl: let the kernel answer an ioctl by itself
+ *
+ * Meant for _IOR ioctls that only report something, like a version
+ * or the current mode, which clients ask over and over.
+ *
+ * Arguments:
+ *    fd - the file descriptor previously returned by fusd_register.
+ *    cmd - the ioctl; it must be _IOR (no _IOW or _IOWR).
+ *    ttl_msecs - how long an answer holds before asking you again,
+ *    0 for as long as you don't say otherwise.
+ *    answer - the _IOC_SIZE(cmd) bytes to give callers, or NULL to
+ *    have the kernel keep the next answer your ioctl callback gives
+ *    (if it returns >= 0).
+ *    retval - what callers get returned along with answer (>= 0).
+ *
+ * Calling it again for the same cmd replaces the answer.  At most
+ * 64 ioctls per device can be cached.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure.
+ */
+int fusd_cache_ioctl(int fd, unsigned int cmd, unsigned int ttl_msecs,
+                     const void *answer, int retval);
+
+
+/* fusd_uncache_ioctl: the answer the kernel holds for cmd (or for
+ * every ioctl, if cmd is 0) is stale.  The next call of it reaches
+ * your ioctl callback, whose answer is kept again -- unless forget is
+ * nonzero, which stops caching it at all.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure.
+ */
+int fusd_uncache_ioctl(int fd, unsigned int cmd, int forget);
+
+
+/* fusd_stream_push: give data to the readers of a stream device
+ *
+ * Arguments:
+ *    fd - the file descriptor previously returned by fusd_register.
+ *    file_id - the file to push to (see fusd_get_file_id), or NULL
+ *    for every file open at the moment.
+ *    data, length - the data, at most 64k.
+ *    eof - nonzero if nothing follows: once the data is read, reads
+ *    return 0 (until you push more).
+ *
+ * The data is appended to a ring the kernel keeps for each file of a
+ * FUSD_DEV_STREAM device.  A push is all or nothing: it fails with
+ * EAGAIN if the file's ring hasn't room for all of it.  Pushes to
+ * every file skip those that haven't, and succeed.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure.
+ */
+int fusd_stream_push(int fd, void *file_id, const void *data, size_t length,
+                     int eof);
+
+
+/* fusd_copy_from_client, fusd_copy_to_client: access the memory of
+ * the process making a call, while you're handling it
+ *
+ * Arguments:
+ *    file - the call, as passed to your callback (or saved, with
+ *    -FUSD_NOREPLY: the call is pending until you fusd_return it).
+ *    client_src, client_dst - an address in the client's memory, as
+ *    found in an ioctl's argument (for ioctls that don't copy their
+ *    argument, the argument itself).
+ *    buf, length - your side of the copy, any size.
+ *
+ * This is the way to handle ioctls whose arguments point to more
+ * data, or move more of it than an ioctl number can describe.
+ *
+ * Return value:
+ *    The number of bytes copied, fewer than length if part of the
+ *    client's range isn't mapped.
+ *   -1 on failure with errno set: ESRCH if the call is no longer
+ *    pending (or its caller isn't waiting for it, e.g. it was
+ *    interrupted), EPERM if you may not ptrace the caller, EFAULT if
+ *    nothing could be copied.
+ */
+ssize_t fusd_copy_from_client(struct fusd_file_info *file, void *buf,
+                              const void *client_src, size_t length);
+ssize_t fusd_copy_to_client(struct fusd_file_info *file, void *client_dst,
+                            const void *buf, size_t length);
+
+
+/* fusd_mmap_fd: answer a client's mmap with a file of your own
+ *
+ * Call it from your mmap callback (or before you fusd_return an mmap
+ * you deferred), then return 0.  The client's mapping goes straight
+ * onto the file, as if the client had mmapped it itself: its page
+ * faults are the file's, handled by the kernel without walking your
+ * address space (or waking you).  What you write to the file, the
+ * client sees, and the other way around with MAP_SHARED.
+ *
+ * Arguments:
+ *    file - the mmap call, as passed to your callback.
+ *    fd - a memfd (memfd_create, without MFD_HUGETLB) or other shmem
+ *    file, such as one on tmpfs; the client's mmap fails with EINVAL
+ *    for anything else.  You may close it as soon as the call is
+ *    answered.
+ *    offset - where in the file the client's mapping starts; a
+ *    multiple of the page size.
+ *
+ * The addr and length your callback returns are ignored, and so is
+ * FUSD_DEV_MMAP_POPULATE.  A client asking for a writable shared
+ * mapping is refused with EACCES unless fd was opened for writing.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure.
+ */
+int fusd_mmap_fd(struct fusd_file_info *file, int fd, off_t offset);
+
+
+/* fusd_set_readahead: turn on (or off, with 0) read-ahead on a device
+ *
+ * When a client reads a file sequentially, the kernel asks your read
+ * callback for more than the client did -- up to max_bytes, at most
+ * 128k -- and keeps the rest for the client's next reads.  That's
+ * harmless for files and for streams whose data stays meant for the
+ * same client, but not for devices where reading has other side
+ * effects, so it's off by default.
+ *
+ * What a file read ahead is thrown away when it is written to or gets
+ * an ioctl, when you call fusd_invalidate_cache (for every file), and
+ * when you push its readiness.  Writes through another file don't
+ * count: invalidate if they change what this one reads.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure.
+ */
+int fusd_set_readahead(int fd, unsigned int max_bytes);
+
+
+/* fusd_set_file_group: put a file in a group of your choosing (any
+ * non-zero number; 0 takes it out of its group) for use with
+ * fusd_broadcast_readiness.  Files start out in no group. */
+int fusd_set_file_group(int fd, void *file_id, unsigned int group);
+
+
+/* fusd_broadcast_readiness: like fusd_set_readiness, for all the open
+ * files of a device at once
+ *
+ * Arguments:
+ *    fd - the file descriptor previously returned by fusd_register.
+ *    group - only update files in this group, or every open file of
+ *    the device if 0.
+ *    set - FUSD_NOTIFY_* bits that became true, e.g. FUSD_NOTIFY_INPUT
+ *    when new data arrived for all subscribers.
+ *    clear - FUSD_NOTIFY_* bits that became false.
+ *
+ * Return value:
+ *    0 on success.
+ *   -1 on failure with errno set to indicate the failure.
+ */
+int fusd_broadcast_readiness(int fd, unsigned int group, unsigned int set,
+                             unsigned int clear);
+
+
 /* fusd_return: unblock a previously blocked system call
  * 
  * Arguments:
@@ -278,6 +676,11 @@ static inline void * fusd_get_ioctl_buffer(struct fusd_file_info *file)
 static inline int fusd_get_poll_diff_cached_state(struct fusd_file_info *file)
 { return file->fusd_msg->parm.fops_msg.cmd; }
 
+/* identifies the open file a call is made on, for as long as it stays
+ * open; see fusd_set_readiness */
+static inline void * fusd_get_file_id(struct fusd_file_info *file)
+{ return file->fusd_msg->parm.fops_msg.fusd_file; }
+
 /* returns static string representing the flagset (e.g. RWE) */
 char *fusd_unparse_flags(int flags);
 
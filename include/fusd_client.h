@@ -0,0 +1,97 @@
+/*
+ *
+ * Copyright (c) 2003 The Regents of the University of California.  All 
+ * rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * - Neither the name of the University nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+ 
+
+/*
+ * FUSD: the Framework for User-Space Devices
+ *
+ * Helpers for programs using FUSD devices (not drivers: those want
+ * fusd.h).  Everything here is inline; there is nothing to link.
+ */
+
+#ifndef __FUSD_CLIENT_H__
+#define __FUSD_CLIENT_H__
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include "fusd_msg.h"
+
+/* Batches: many small reads and ioctls on a FUSD device in a single
+ * system call, and a single round trip to its driver.  Fill an array
+ * of ops with fusd_batch_read and fusd_batch_ioctl, then submit it:
+ *
+ *     fusd_batch_op_t ops[2];
+ *     fusd_batch_read(&ops[0], status, sizeof(status), 0);
+ *     fusd_batch_ioctl(&ops[1], GET_MODE, &mode);
+ *     if (fusd_batch_submit(fd, ops, 2) == 0 && ops[1].result >= 0)
+ *       ...
+ *
+ * The ops run in order.  Each gets in result what read (but with the
+ * position given, as in pread) or ioctl would have returned, or
+ * -errno -- EAGAIN if the driver couldn't answer it right away.
+ */
+
+static inline void fusd_batch_read(fusd_batch_op_t *op, void *buf,
+                                   unsigned int length, long long offset)
+{
+  memset(op, 0, sizeof(*op));
+  op->op = FUSD_BATCH_READ;
+  op->arg = buf;
+  op->length = length;
+  op->offset = offset;
+}
+
+static inline void fusd_batch_ioctl(fusd_batch_op_t *op, unsigned int cmd,
+                                    void *arg)
+{
+  memset(op, 0, sizeof(*op));
+  op->op = FUSD_BATCH_IOCTL;
+  op->cmd = cmd;
+  op->arg = arg;
+}
+
+/* fusd_batch_submit: runs count (at most FUSD_BATCH_MAX_OPS) ops on
+ * fd.  Returns 0 if they ran -- check their results -- or -1 with
+ * errno set if the batch couldn't be run at all (E2BIG if they read
+ * or pass more than 128k in all; ENOSYS if the driver predates
+ * batches). */
+static inline int fusd_batch_submit(int fd, fusd_batch_op_t *ops,
+                                    unsigned int count)
+{
+  fusd_batch_t batch;
+
+  batch.ops = ops;
+  batch.count = count;
+  return ioctl(fd, FUSD_IOC_BATCH, &batch);
+}
+
+#endif /* __FUSD_CLIENT_H__ */
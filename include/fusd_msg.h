@@ -50,8 +50,18 @@
 /* ioctl number to tell FUSD status device to return binary info */
 #define FUSD_STATUS_USE_BINARY     _IO('F', 100)
 
+/* ioctls on the control channel: access the memory of a client while
+ * it's in a call to the driver (see fusd_client_copy_t) */
+#define FUSD_COPY_FROM_CLIENT      _IOW('F', 101, fusd_client_copy_t)
+#define FUSD_COPY_TO_CLIENT        _IOW('F', 102, fusd_client_copy_t)
+
+/* ioctl on every client file, answered by FUSD itself (drivers never
+ * see this number): a batch of reads and ioctls (see fusd_batch_t) */
+#define FUSD_IOC_BATCH             _IOW('F', 103, fusd_batch_t)
+
 /* constants */
 #define FUSD_MAX_NAME_LENGTH       47 /* 47, to avoid expanding union size */
+#define FUSD_INLINE_MAX            127 /* largest payload sent in the header */
 
 
 /* commands */
@@ -68,6 +78,8 @@
 
 #define FUSD_FOPS_CALL_DROPREPLY   6 /* call that doesn't want a reply */
 
+#define FUSD_DEVICE_CONTROL        7 /* driver->kernel device setting, no reply */
+
 /* subcommands */
 #define FUSD_OPEN                  100
 #define FUSD_CLOSE                 101
@@ -77,6 +89,91 @@
 #define FUSD_POLL_DIFF             105
 #define FUSD_UNBLOCK               106
 #define FUSD_MMAP                  107
+#define FUSD_STREAM_LOW            108 /* stream ring running low, no reply */
+#define FUSD_BATCH                 109 /* ops of a FUSD_IOC_BATCH ioctl */
+#define FUSD_FAULT                 110 /* client touched an mmap page */
+#define FUSD_MUNMAP                111 /* client mmap gone, no reply */
+
+/* device control subcommands (FUSD_DEVICE_CONTROL) */
+#define FUSD_CTL_SET_IOCTL_RANGES  200
+#define FUSD_CTL_SET_FLAGS         201
+#define FUSD_CTL_SET_OPEN_POLICY   202
+#define FUSD_CTL_FLUSH_OPEN_CACHE  203
+#define FUSD_CTL_SET_READINESS     204
+#define FUSD_CTL_SET_GROUP         205
+#define FUSD_CTL_BROADCAST_READINESS 206
+#define FUSD_CTL_SET_FILE_META     207
+#define FUSD_CTL_INVALIDATE_CACHE  208
+#define FUSD_CTL_SET_READAHEAD     209
+#define FUSD_CTL_STREAM_PUSH       210
+#define FUSD_CTL_SET_COALESCE      211
+#define FUSD_CTL_CACHE_IOCTL       212
+#define FUSD_CTL_UNCACHE_IOCTL     213
+
+/* per-device behavior flags (FUSD_CTL_SET_FLAGS) */
+#define FUSD_DEV_ASYNC_CLOSE       0x0001 /* close doesn't wait for driver */
+#define FUSD_DEV_NONBLOCK_CACHED   0x0002 /* O_NONBLOCK uses cached readiness */
+#define FUSD_DEV_PAGE_CACHE        0x0004 /* kernel caches read data */
+#define FUSD_DEV_STREAM            0x0008 /* reads come from pushed data */
+#define FUSD_DEV_WRITE_BEHIND      0x0010 /* writes are buffered, sent later */
+#define FUSD_DEV_COALESCE          0x0020 /* ...and small ones merged */
+#define FUSD_DEV_MMAP_POPULATE     0x0040 /* mmap maps in the whole buffer */
+#define FUSD_DEV_MMAP_FAULT        0x0080 /* mmap pages asked for when touched */
+#define FUSD_DEV_MMAP_MKWRITE      0x0100 /* ...and first writes reported */
+#define FUSD_DEV_ALL_FLAGS         0x01ff /* every flag above */
+
+/* FUSD_MMAP reply flag (fops_msg.mmflags): instead of a buffer, the
+ * driver answered with a file to map, fd in fops_msg.cmd, offset into
+ * it in fops_msg.mmoffset */
+#define FUSD_MMAP_FD               0x80000000
+
+/* FUSD_CTL_STREAM_PUSH flags (ctl_msg.set) */
+#define FUSD_STREAM_EOF            0x0001 /* nothing follows this data */
+
+/* FUSD_CTL_UNCACHE_IOCTL flags (ctl_msg.set) */
+#define FUSD_UNCACHE_FORGET        0x0001 /* no longer cacheable at all */
+
+/* batch operations (fusd_batch_op_t) */
+#define FUSD_BATCH_READ            1 /* read length bytes at offset */
+#define FUSD_BATCH_IOCTL           2 /* ioctl cmd with arg */
+#define FUSD_BATCH_DONE            0x80 /* K->U: already done, skip it */
+
+/* maximum number of operations in a batch */
+#define FUSD_BATCH_MAX_OPS         64
+
+/* number of ioctls a device may have the kernel answer */
+#define FUSD_MAX_CACHED_IOCTLS     64
+
+/* capability bits sent at registration time: which callbacks the
+ * driver implements.  Operations the driver does not implement are
+ * completed by the kernel module without a round trip. */
+#define FUSD_CAP_OPEN              0x0001
+#define FUSD_CAP_CLOSE             0x0002
+#define FUSD_CAP_READ              0x0004
+#define FUSD_CAP_WRITE             0x0008
+#define FUSD_CAP_IOCTL             0x0010
+#define FUSD_CAP_POLL_DIFF         0x0020
+#define FUSD_CAP_UNBLOCK           0x0040
+#define FUSD_CAP_MMAP              0x0080
+#define FUSD_CAP_STREAM_LOW        0x0100
+#define FUSD_CAP_FAULT             0x0200
+#define FUSD_CAP_MUNMAP            0x0400
+#define FUSD_CAP_DECLARED          0x8000 /* caps field is meaningful */
+
+/* maximum number of ioctl ranges a device can declare */
+#define FUSD_MAX_IOCTL_RANGES      32
+
+/* open policy flags (fusd_open_policy_t) */
+#define FUSD_POLICY_FINAL          0x0001 /* allowed opens skip the driver */
+#define FUSD_POLICY_CACHE          0x0002 /* remember open verdicts per uid */
+
+/* per-file metadata fields (fusd_file_meta_t) */
+#define FUSD_META_AVAIL            0x0001 /* bytes readable (FIONREAD) */
+#define FUSD_META_SIZE             0x0002 /* logical size (SEEK_END) */
+#define FUSD_META_SEEKABLE         0x0004 /* whether lseek is allowed */
+
+/* maximum number of uids (and of gids) in an open policy */
+#define FUSD_MAX_POLICY_IDS        64
 
 /* other constants */
 #define FUSD_MSG_MAGIC      0x7a6b93cd
@@ -90,9 +187,18 @@ typedef struct {
 	char devname[FUSD_MAX_NAME_LENGTH+1];
   mode_t mode;
   void *device_info;
+  unsigned int caps;		/* FUSD_CAP_* bits */
 } register_msg_t;
 
 
+/* user->kernel: an inclusive range of ioctl numbers accepted by a
+ * device (data part of FUSD_CTL_SET_IOCTL_RANGES) */
+typedef struct {
+  unsigned int first;
+  unsigned int last;
+} fusd_ioctl_range_t;
+
+
 /* kernel->user: fops request message (common data) */
 typedef struct {
   pid_t pid;
@@ -108,7 +214,7 @@ typedef struct {
   ssize_t retval;
   unsigned long length;
   unsigned long offset;
-  unsigned int cmd;  /* ioctl cmd, poll_diff cached_state */
+  unsigned int cmd;  /* ioctl cmd, poll_diff cached_state, mmap fd */
 
   /* mmap parameters */
   unsigned long mmprot;
@@ -128,6 +234,66 @@ typedef struct {
 } fops_msg_t;
 
 
+/* user->kernel: open policy evaluated by the kernel before it asks
+ * the driver (data part of FUSD_CTL_SET_OPEN_POLICY).  The header is
+ * followed by num_uids uid_t's, then num_gids gid_t's.  If either set
+ * is non-empty, callers matching neither are refused with -EPERM, and
+ * with FUSD_POLICY_FINAL callers matching one are let in. */
+typedef struct {
+  unsigned int flags;		/* FUSD_POLICY_* */
+  unsigned int cache_ttl;	/* msec a cached verdict lasts, 0 = forever */
+  int num_uids;
+  int num_gids;
+} fusd_open_policy_t;
+
+
+/* user->kernel: metadata the kernel answers queries with on its own
+ * (data part of FUSD_CTL_SET_FILE_META).  Only the fields named in
+ * 'valid' are updated; the fields named in ctl_msg.clear are
+ * forgotten, so those queries go back to the driver. */
+typedef struct {
+  unsigned int valid;		/* FUSD_META_* */
+  int seekable;
+  long long avail;
+  long long size;
+} fusd_file_meta_t;
+
+
+/* user->kernel: a byte range of the device whose cached data is now
+ * stale (data part of FUSD_CTL_INVALIDATE_CACHE; no data means the
+ * whole device).  A length of 0 runs to the end of the device. */
+typedef struct {
+  long long offset;
+  long long length;
+} fusd_cache_range_t;
+
+
+/* user->kernel: an _IOR ioctl the kernel may answer by itself (data
+ * part of FUSD_CTL_CACHE_IOCTL).  If _IOC_SIZE(cmd) bytes of response
+ * follow, they are the answer; if not, the kernel keeps the next one
+ * the driver gives. */
+typedef struct {
+  unsigned int cmd;
+  unsigned int ttl;		/* msecs the answer holds, 0 for ever */
+  int retval;			/* returned along with a pushed answer */
+} fusd_ioctl_cache_t;
+
+
+/* user->kernel: device control message (common data) */
+typedef struct {
+  void *fusd_file;		/* target file, for per-file settings
+				   (NULL for every file, where allowed) */
+  unsigned int set;		/* bits to set (flags, FUSD_NOTIFY_*) */
+  unsigned int clear;		/* bits to clear */
+  unsigned int id;		/* uid for FUSD_CTL_FLUSH_OPEN_CACHE,
+				   group for the group messages,
+				   bytes for FUSD_CTL_SET_READAHEAD,
+				   usecs for FUSD_CTL_SET_COALESCE,
+				   cmd (0 for all) for
+				   FUSD_CTL_UNCACHE_IOCTL */
+} ctl_msg_t;
+
+
 /* the message struct written to FUSD control channel */
 typedef struct {
   int magic;
@@ -143,11 +309,52 @@ typedef struct {
   union {
     register_msg_t register_msg; /* device registration (U->K) */
     fops_msg_t fops_msg;	/* U->K and K->U fops messages */
+    ctl_msg_t ctl_msg;		/* device control (U->K) */
   } parm;
+
+  /* payloads of up to FUSD_INLINE_MAX bytes may travel here instead
+   * of after the header, sparing a read (or write) and an allocation.
+   * Kernel->user, such messages have a NULL data pointer; user->kernel,
+   * they're written without a data part.  (The extra byte is for
+   * libfusd's terminating NUL.) */
+  char inline_data[FUSD_INLINE_MAX + 1];
 } fusd_msg_t;
 
 
-/* structure read from FUSD binary status device */
+/* argument of the FUSD_COPY_*_CLIENT ioctls */
+typedef struct {
+  void *fusd_file;		/* file the call was made on */
+  long transid;			/* the call, which must still be pending */
+  unsigned long client_addr;	/* where in the client's memory */
+  void *buf;			/* where in the driver's */
+  unsigned long length;
+} fusd_client_copy_t;
+
+
+/* one operation of a FUSD_IOC_BATCH ioctl.  The driver gets these
+ * in a FUSD_BATCH message (parm.fops_msg.length of them), each
+ * followed in turn by length bytes of data: the ioctl argument, or
+ * room for what is read.  It sends them all back with result set. */
+typedef struct {
+  long long offset;		/* where to read (the file position
+				   doesn't move) */
+  void *arg;			/* buffer to read into, or ioctl argument */
+  unsigned int op;		/* FUSD_BATCH_* */
+  unsigned int cmd;		/* the ioctl */
+  unsigned int length;		/* bytes to read; K->U, bytes of data */
+  int result;			/* what read or ioctl returned (or -errno) */
+} fusd_batch_op_t;
+
+/* argument of the FUSD_IOC_BATCH ioctl */
+typedef struct {
+  fusd_batch_op_t *ops;		/* results are written back here */
+  unsigned int count;		/* at most FUSD_BATCH_MAX_OPS */
+} fusd_batch_t;
+
+
+/* structure read from FUSD binary status device.  Readers step
+ * through an array of these, so it must not grow: newer counters
+ * (page cache, write-behind) are in the text output only. */
 typedef struct {
   char name[FUSD_MAX_NAME_LENGTH+1];
   int zombie;
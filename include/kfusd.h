@@ -60,15 +60,39 @@
 /* maximum read/write size we're willing to service */
 # define MAX_RW_SIZE         (1024*128)
 
+/* size of a file's stream ring (FUSD_DEV_STREAM), and how empty it
+ * gets before the driver is told to push more */
+# define FUSD_STREAM_SIZE    (1024*64)
+# define FUSD_STREAM_LOW_MARK (FUSD_STREAM_SIZE/4)
+
+/* how much a file buffers of its writes (FUSD_DEV_WRITE_BEHIND) */
+# define FUSD_WB_SIZE        (1024*64)
+
+/* longest a small write is held back to be merged with the next ones
+ * (FUSD_DEV_COALESCE), unless the driver changes it */
+# define FUSD_COALESCE_DELAY_DEFAULT 1000 /* usecs */
+
+/* pages of the driver's mmap buffer mapped in around a faulting one
+ * (all of it, if it's part of a huge page), and looked up at a time */
+# define FUSD_MMAP_FAULT_AROUND 16
+# define FUSD_MMAP_CHUNK     16
+
+/* kernel's own FUSD_MMAP reply flag: the driver's FUSD_MMAP_FD has
+ * been looked up, and fops_msg.arg.ptr_arg holds a reference to the
+ * file (dropped by free_fusd_msg) */
+# define FUSD_MMAP_FILE      0x40000000
+
 
 /********************** Structure Definitions *******************************/
 
 /* Container for a fusd msg */
 typedef struct fusd_msgC_s_t fusd_msgC_t;
+struct fusd_file_s;
 
 struct fusd_msgC_s_t {
   fusd_msg_t fusd_msg;		/* the message itself */
   fusd_msgC_t *next;		/* pointer to next one in the list */
+  struct fusd_file_s *release_file; /* file to free once this is read */
 
   /* 1-bit flags */
   unsigned int peeked:1;	/* has the first half of this been read? */
@@ -82,8 +106,55 @@ struct fusd_transaction
 	int pid;
 	int size;
 	fusd_msg_t* msg_in;
+	wait_queue_head_t wait;	/* the caller waits here for msg_in */
+	struct task_struct *task; /* the caller (referenced) */
+	struct mm_struct *mm;	/* its memory as of the call (pinned),
+				   which the driver may access while
+				   the caller waits */
+	int waiting;		/* the caller is blocked on the reply */
+	int async;		/* nobody's syscall waits for it
+				   (write-behind): never restarted */
+	unsigned long offset;	/* FUSD_FAULT: the range asked for (its */
+	int prot;		/* length is the size), and how */
+};
+
+/* an open() verdict returned by the driver, cached per uid and
+ * access mode */
+struct fusd_open_verdict {
+  int valid;
+  uid_t uid;
+  int accmode;			/* f_flags & O_ACCMODE of the open */
+  int retval;			/* 0, -EPERM or -EACCES */
+  unsigned long expires;	/* in jiffies, unless the policy has no ttl */
+};
+
+/* the kernel's answer to an ioctl the driver marked cacheable */
+struct fusd_ioctl_answer {
+  struct list_head list;
+  unsigned int cmd;
+  unsigned long ttl;		/* in jiffies, 0 for ever */
+  unsigned long expires;
+  int valid;			/* retval and data hold an answer */
+  int retval;
+  char data[0];			/* _IOC_SIZE(cmd) bytes */
+};
+
+/* a page of read data cached for a FUSD_DEV_PAGE_CACHE device */
+struct fusd_cache_page {
+  struct list_head lru;		/* on the global LRU, most recent first */
+  struct fusd_dev_t_s *fusd_dev; /* device whose page_cache holds us */
+  unsigned long index;		/* offset in the device, in pages */
+  unsigned int len;		/* valid bytes; < PAGE_SIZE only at EOF */
+  struct page *page;
 };
 
+/* pages cached for all devices together, at most; the shrinker may
+ * keep it well under that */
+# define FUSD_CACHE_MAX_PAGES 4096
+
+/* number of verdicts cached per device (direct mapped by uid) */
+# define FUSD_OPEN_CACHE_SIZE 64
+
 /* magical forward declarations to break the circular dependency */
 struct fusd_dev_t_s;
 typedef struct fusd_dev_t_s fusd_dev_t;
@@ -91,7 +162,7 @@ struct CLASS;
 struct device;
 
 /* state kept per opened file (i.e., an instance of a device) */
-typedef struct {
+typedef struct fusd_file_s {
   /* general state management */
   int magic;			/* magic number for sanity checking */
   fusd_dev_t *fusd_dev;		/* fusd device associated with this file */
@@ -100,12 +171,67 @@ typedef struct {
   struct file *file;		/* kernel's file pointer for this file */
   int index;			/* our index in our device's file array */
   struct semaphore file_sem;	/* Semaphore for file structure */
-  int cached_poll_state;	/* Latest result from a poll diff req */
-  int last_poll_sent;		/* Last polldiff request we sent */
+  int local_open;		/* Open was decided by the open policy;
+				   the driver never heard of this file */
+  unsigned int group;		/* Driver-assigned group, 0 for none */
+
+  /* metadata published by the driver (FUSD_CTL_SET_FILE_META) */
+  spinlock_t meta_lock;		/* Protects the fields below */
+  unsigned int meta_valid;	/* FUSD_META_* fields we know */
+  int meta_seekable;
+  loff_t meta_avail;
+  loff_t meta_size;
+
+  /* read-ahead state, under file_sem (see fusd_readahead_serve) */
+  loff_t ra_next;		/* Where a sequential read would start */
+  int ra_seq;			/* Sequential reads in a row */
+  int ra_window;		/* Current read-ahead size */
+  long ra_transid;		/* Outstanding read-ahead read, or 0 */
+  loff_t ra_sent_pos;		/* ...and the offset it was sent for */
+  fusd_msg_t *ra_msg;		/* Reply holding the data read ahead */
+  int ra_head;			/* First unread byte of ra_msg->data */
+  int ra_len;			/* Unread bytes left in ra_msg */
+  loff_t ra_pos;		/* Offset a read must have to use them */
+  loff_t ra_end;		/* Offset once they've all been read */
+  int ra_linear;		/* Offsets advance with the bytes read */
+  int ra_stale;			/* The driver invalidated its data or
+				   pushed readiness since it was asked */
+
+  /* stream ring (FUSD_DEV_STREAM), filled by the driver */
+  spinlock_t stream_lock;	/* Protects the ring's head and length */
+  char *stream_buf;		/* FUSD_STREAM_SIZE bytes, or NULL */
+  int stream_head;		/* Offset of the first unread byte */
+  int stream_len;		/* Unread bytes in the ring */
+  int stream_eof;		/* Reads return 0 once the ring is empty */
+  int stream_low_sent;		/* FUSD_STREAM_LOW sent, no push since */
+
+  /* write-behind (FUSD_DEV_WRITE_BEHIND), under file_sem */
+  char *wb_buf;			/* Writes not sent yet, or NULL */
+  int wb_len;			/* Bytes in wb_buf */
+  int wb_nwrites;		/* Client writes they came from */
+  loff_t wb_pos;		/* Offset they were written at */
+  pid_t wb_pid;			/* Who wrote them */
+  uid_t wb_uid;
+  gid_t wb_gid;
+  struct fusd_transaction *wb_transaction; /* Write in flight, or NULL */
+  int wb_done;			/* ...and its reply is in */
+  int wb_sent;			/* Bytes in that write */
+  int wb_error;			/* Reported by the next write or fsync */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+  struct work_struct wb_work;	/* Sends more when a write completes */
+#else
+  struct delayed_work wb_work;	/* Sends more when a write completes,
+				   or when small writes waited enough */
+#endif
+  atomic_t cached_poll_state;	/* Latest result from a poll diff req */
+  atomic_t last_poll_sent;	/* Last polldiff request we sent */
 
   /* structures used for messaging */
-  wait_queue_head_t file_wait;	/* Wait on this for a user->kernel msg */
+  wait_queue_head_t file_wait;	/* Woken when the device goes away
+				   or data is pushed into the stream
+				   (replies wake their transaction) */
   wait_queue_head_t poll_wait;  /* Given to kernel for poll() queue */
+  struct fasync_struct *fasync;	/* Owners wanting SIGIO on readiness */
 	struct list_head transactions;
 	struct semaphore transactions_sem;
 	
@@ -134,6 +260,29 @@ struct fusd_dev_t_s {
   struct cdev* handle;
   dev_t dev_id;
 
+  /* what the driver implements; see FUSD_CAP_* */
+  unsigned int caps;		/* Callbacks declared at registration */
+  unsigned int flags;		/* FUSD_DEV_* behavior flags */
+  fusd_ioctl_range_t *ioctl_ranges; /* Accepted ioctls, NULL for all */
+  int num_ioctl_ranges;		/* Entries in ioctl_ranges */
+  fusd_open_policy_t *open_policy; /* Followed by its uids and gids */
+  struct fusd_open_verdict *open_cache; /* Only with FUSD_POLICY_CACHE */
+  unsigned long open_cache_gen;	/* Bumped by every flush of open_cache */
+
+  /* page cache (FUSD_DEV_PAGE_CACHE), under fusd_cache_lock */
+  struct radix_tree_root page_cache; /* fusd_cache_page's by index */
+  unsigned long cache_gen;	/* Bumped by every invalidation */
+  unsigned long cache_hits;
+  unsigned long cache_misses;
+
+  int ra_max;			/* Read-ahead window limit, 0 for none */
+  struct list_head ioctl_cache;	/* struct fusd_ioctl_answer's */
+  unsigned long ioctl_cache_gen; /* bumped whenever answers change */
+
+  unsigned long coalesce_delay;	/* Jiffies small writes may wait */
+  unsigned long wb_writes;	/* Writes buffered by write-behind */
+  unsigned long wb_msgs;	/* Write messages they were sent in */
+
   fusd_file_t **files;		/* Array of this device's open files */
   int array_size;		/* Size of the array pointed to by 'files' */
   int num_files;		/* Number of array entries that are valid */
@@ -159,6 +308,14 @@ struct fusd_dev_t_s {
 #  define WAKE_UP_INTERRUPTIBLE_SYNC(x) wake_up_interruptible(x)
 # endif /* CONFIG_FUSD_USE_WAKEUPSYNC */
 
+/* keyed wakeup of a poll queue: only pollers interested in one of the
+ * bits are woken, and EPOLLEXCLUSIVE waiters one at a time */
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+#  define WAKE_UP_POLL(x, bits) wake_up_interruptible_poll(x, bits)
+# else
+#  define WAKE_UP_POLL(x, bits) wake_up_interruptible(x)
+# endif
+
 # ifdef CONFIG_FUSD_DEBUG
 static void rdebug_real(char *fmt, ...)
   __attribute__ ((format (printf, 1, 2)));
@@ -173,6 +330,15 @@ static void rdebug_real(char *fmt, ...)
 
 # define ZOMBIE(fusd_dev)  ((fusd_dev)->zombie)
 
+/* coalescing implies write-behind */
+# define FUSD_WRITE_BEHIND(fusd_dev) \
+  ((fusd_dev)->flags & (FUSD_DEV_WRITE_BEHIND | FUSD_DEV_COALESCE))
+
+/* does the driver implement a callback?  drivers that did not declare
+ * their capabilities are assumed to implement everything. */
+# define FUSD_DEV_HAS(fusd_dev, cap) \
+  (!((fusd_dev)->caps & FUSD_CAP_DECLARED) || ((fusd_dev)->caps & (cap)))
+
 
 # define GET_FUSD_DEV(candidate, fusd_dev) do { \
   fusd_dev = candidate; \
@@ -76,15 +76,31 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/highmem.h>
+#include <linux/radix-tree.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/sched.h>
+#include <linux/file.h>
+#include <linux/shmem_fs.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #include <linux/sched/signal.h>
+#include <linux/sched/mm.h>
+#endif
+#include <linux/ptrace.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
+#include <linux/cred.h>
 #endif
 
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 #include <asm/ioctl.h>
+#include <asm/ioctls.h>
 #include <asm/pgtable.h>
 #include <asm/pgalloc.h>
 
@@ -104,6 +120,27 @@
 /* Define this to check for memory leaks */
 /*#define CONFIG_FUSD_MEMDEBUG*/
 
+/* Define this to return the page cache's memory to the system on
+ * demand (needs a 3.12+ kernel; older ones only get the size cap) */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
+#define CONFIG_FUSD_CACHE_SHRINKER
+#endif
+
+/* Define this to let clients splice to and from devices without the
+ * data being copied on its way between the pipe and the driver's
+ * replies (written for the pipe ring of 5.5, and the pipe buffer
+ * operations before 5.8) */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+#define CONFIG_FUSD_SPLICE
+#endif
+
+/* Define this to let drivers fill their memfd-backed mappings as
+ * clients fault them in (FUSD_DEV_MMAP_FAULT) */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+#define CONFIG_FUSD_MMAP_FAULT
+#endif
+
 /* Define this to use the faster wake_up_interruptible_sync instead of
  * the normal wake_up_interruptible.  Note: you can't do this unless
  * you're bulding fusd as part of the kernel (not a module); or you've
@@ -164,6 +201,40 @@
 #define FULL_NAME_HASH(h, a, b) full_name_hash(a, b)
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+#define CURRENT_UID() from_kuid_munged(&init_user_ns, current_uid())
+#define CURRENT_GID() from_kgid_munged(&init_user_ns, current_gid())
+#define IN_GROUP(g) in_group_p(make_kgid(&init_user_ns, g))
+#else
+#define CURRENT_UID() current_uid()
+#define CURRENT_GID() current_gid()
+#define IN_GROUP(g) in_group_p(g)
+#endif
+
+/* wb_work is a delayed work, or a plain work (which could be delayed
+ * too) before 2.6.20 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+#define FUSD_INIT_WORK(w, fn) INIT_WORK(w, (void (*)(void *)) (fn), w)
+#define FUSD_DELAYED_WORK(work) (work)
+#else
+#define FUSD_INIT_WORK(w, fn) INIT_DELAYED_WORK(w, fn)
+#define FUSD_DELAYED_WORK(work) container_of(work, struct delayed_work, work)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 23)
+#define FUSD_CANCEL_WORK(w) do { cancel_delayed_work(w); flush_scheduled_work(); } while (0)
+#else
+#define FUSD_CANCEL_WORK(w) cancel_delayed_work_sync(w)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
+#define FILE_INODE(f) file_inode(f)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20)
+#define FILE_INODE(f) ((f)->f_path.dentry->d_inode)
+#else
+#define FILE_INODE(f) ((f)->f_dentry->d_inode)
+#endif
+
 /**************************************************************************/
 
 #include "fusd.h"
@@ -217,20 +288,37 @@ MODULE_LICENSE ("GPL");
 
 /**** Function Prototypes ****/
 static int maybe_free_fusd_dev(fusd_dev_t *fusd_dev);
+static void fusd_cache_invalidate(fusd_dev_t *fusd_dev, loff_t offset, loff_t length);
 
 static int find_fusd_file(fusd_dev_t *fusd_dev, fusd_file_t *fusd_file);
 static int free_fusd_file(fusd_dev_t *fusd_dev, fusd_file_t *fusd_file);
 
 static int fusd_fops_call_send(fusd_file_t *fusd_file_arg,
                                fusd_msg_t *fusd_msg, struct fusd_transaction** transaction);
+static int __fusd_fops_call_send(fusd_file_t *fusd_file_arg, fusd_msg_t *fusd_msg,
+                                 struct fusd_transaction **transaction, int locked);
+static void fusd_send_polldiff(fusd_file_t *fusd_file, int locked);
+static void fusd_notify_readiness(fusd_file_t *fusd_file, int new_bits);
+static void fusd_wb_work(struct work_struct *work);
 static int fusd_fops_call_wait(fusd_file_t *fusd_file_arg,
                                fusd_msg_t **fusd_msg_reply, struct fusd_transaction* transaction);
+static int __fusd_fops_call_wait(fusd_file_t *fusd_file_arg, fusd_msg_t **fusd_msg_reply,
+                                 struct fusd_transaction *transaction, int file_locked);
 
 static void fusd_forge_close(fusd_msg_t *msg, fusd_dev_t *fusd_dev);
 
 static int fusd_add_transaction(fusd_file_t *fusd_file, int transid, int subcmd, int size, struct fusd_transaction** out_transaction);
 static void fusd_cleanup_transaction(fusd_file_t *fusd_file, struct fusd_transaction* transaction);
 static void fusd_remove_transaction(fusd_file_t *fusd_file, struct fusd_transaction* transaction);
+
+/* let go of what a transaction holds, and of the transaction */
+static void fusd_free_transaction(struct fusd_transaction *transaction)
+{
+	if (transaction->mm != NULL)
+		mmput(transaction->mm);
+	put_task_struct(transaction->task);
+	KFREE(transaction);
+}
 static struct fusd_transaction* fusd_find_transaction(fusd_file_t *fusd_file, int transid);
 static struct fusd_transaction* fusd_find_transaction_by_pid(fusd_file_t *fusd_file, int pid);
 
@@ -434,10 +522,14 @@ static inline void free_fusd_msg(fusd_msg_t **fusd_msg)
 	if (fusd_msg == NULL || *fusd_msg == NULL)
 		return;
 
-	if ((*fusd_msg)->data != NULL) {
+	if ((*fusd_msg)->data != NULL && (*fusd_msg)->data != (*fusd_msg)->inline_data) {
 		VFREE((*fusd_msg)->data);
 		(*fusd_msg)->data = NULL;
 	}
+	/* an mmap reply holding the file the driver answered with */
+	if ((*fusd_msg)->cmd == FUSD_FOPS_REPLY && (*fusd_msg)->subcmd == FUSD_MMAP &&
+	    ((*fusd_msg)->parm.fops_msg.mmflags & FUSD_MMAP_FILE))
+		fput((struct file *) (*fusd_msg)->parm.fops_msg.arg.ptr_arg);
 	RDEBUG(1, "Freeing fusd_msg [%p] then set to NULL", fusd_msg);
 	KFREE(*fusd_msg);
 	*fusd_msg = NULL;
@@ -517,6 +609,7 @@ static fusd_file_t **fusd_dev_adjsize(fusd_dev_t *fusd_dev)
 static int maybe_free_fusd_dev(fusd_dev_t *fusd_dev)
 {
 	fusd_msgC_t *ptr, *next;
+	struct fusd_ioctl_answer *answer, *next_answer;
 
 	down(&fusd_devlist_sem);
 
@@ -559,6 +652,31 @@ static int maybe_free_fusd_dev(fusd_dev_t *fusd_dev)
 	}
 
 
+	/* free the open policy and its verdict cache */
+	if (fusd_dev->open_policy != NULL) {
+		KFREE(fusd_dev->open_policy);
+		fusd_dev->open_policy = NULL;
+	}
+	if (fusd_dev->open_cache != NULL) {
+		KFREE(fusd_dev->open_cache);
+		fusd_dev->open_cache = NULL;
+	}
+
+	/* free whatever it has in the page cache */
+	fusd_cache_invalidate(fusd_dev, 0, 0);
+
+	/* free the cached ioctl answers */
+	list_for_each_entry_safe(answer, next_answer, &fusd_dev->ioctl_cache, list) {
+		list_del(&answer->list);
+		KFREE(answer);
+	}
+
+	/* free the ioctl ranges declared by the driver */
+	if (fusd_dev->ioctl_ranges != NULL) {
+		KFREE(fusd_dev->ioctl_ranges);
+		fusd_dev->ioctl_ranges = NULL;
+	}
+
 	/* free the array used to store pointers to fusd_file_t's */
 	if (fusd_dev->files != NULL) {
 		KFREE(fusd_dev->files);
@@ -604,8 +722,16 @@ static void zombify_dev(fusd_dev_t *fusd_dev)
 
 	/* If there are files holding this device open, wake them up. */
 	for (i = 0; i < fusd_dev->num_files; i++) {
-		wake_up_interruptible(&fusd_dev->files[i]->file_wait);
-		wake_up_interruptible(&fusd_dev->files[i]->poll_wait);
+		fusd_file_t *fusd_file = fusd_dev->files[i];
+		struct fusd_transaction *transaction;
+
+		down(&fusd_file->transactions_sem);
+		list_for_each_entry(transaction, &fusd_file->transactions, list)
+			wake_up_interruptible(&transaction->wait);
+		up(&fusd_file->transactions_sem);
+
+		wake_up_interruptible(&fusd_file->file_wait);
+		wake_up_interruptible(&fusd_file->poll_wait);
 	}
 }
 
@@ -658,10 +784,15 @@ static int free_fusd_file(fusd_dev_t *fusd_dev, fusd_file_t *fusd_file)
 				fusd_forge_close(transaction->msg_in, fusd_dev);
 			free_fusd_msg(&transaction->msg_in);
 		}
-		KFREE(transaction);
+		fusd_free_transaction(transaction);
 	}
 
 	/* free state associated with this file */
+	free_fusd_msg(&fusd_file->ra_msg);
+	if (fusd_file->stream_buf != NULL)
+		VFREE(fusd_file->stream_buf);
+	if (fusd_file->wb_buf != NULL)
+		VFREE(fusd_file->wb_buf);
 	memset(fusd_file, 0, sizeof(fusd_file_t));
 	KFREE(fusd_file);
 
@@ -679,6 +810,259 @@ static int free_fusd_file(fusd_dev_t *fusd_dev, fusd_file_t *fusd_file)
 }
 
 
+/****************************************************************************/
+/******************************* PAGE CACHE *********************************/
+/****************************************************************************/
+
+/*
+ * Devices with FUSD_DEV_PAGE_CACHE set serve static, random-access
+ * content: reading the same offset twice gives the same data until the
+ * driver says otherwise.  We keep what they return in pages indexed by
+ * offset, in a radix tree per device, and serve repeated reads from
+ * there.  Misses are sent to the driver as page-aligned reads so that
+ * whole pages can be cached.
+ *
+ * All pages of all devices are on one LRU list, under one spinlock;
+ * the total is capped at FUSD_CACHE_MAX_PAGES, and a shrinker gives
+ * pages back under memory pressure.  The driver invalidates ranges
+ * with FUSD_CTL_INVALIDATE_CACHE, and client writes invalidate what
+ * they overwrite.  Each invalidation bumps the device's cache_gen, so
+ * that data read before it isn't cached after it.
+ */
+static DEFINE_SPINLOCK(fusd_cache_lock);
+static LIST_HEAD(fusd_cache_lru);
+static unsigned long fusd_cache_pages;
+
+/* free pages taken out of the cache.  CACHE LOCK MUST NOT BE HELD */
+static void fusd_cache_free_list(struct list_head *list)
+{
+	struct fusd_cache_page *cp, *next;
+
+	list_for_each_entry_safe(cp, next, list, lru) {
+		list_del(&cp->lru);
+		__free_page(cp->page);
+		KFREE(cp);
+	}
+}
+
+/* take a page out of the cache, onto 'list'.  CACHE LOCK MUST BE HELD */
+static void fusd_cache_remove(struct fusd_cache_page *cp, struct list_head *list)
+{
+	radix_tree_delete(&cp->fusd_dev->page_cache, cp->index);
+	list_move(&cp->lru, list);
+	fusd_cache_pages--;
+}
+
+/* evict up to nr least recently used pages onto 'list', returns the
+ * number evicted.  CACHE LOCK MUST BE HELD */
+static unsigned long fusd_cache_evict(unsigned long nr, struct list_head *list)
+{
+	unsigned long evicted = 0;
+
+	while (evicted < nr && !list_empty(&fusd_cache_lru)) {
+		fusd_cache_remove(list_entry(fusd_cache_lru.prev,
+		                             struct fusd_cache_page, lru), list);
+		evicted++;
+	}
+	return evicted;
+}
+
+/*
+ * fusd_cache_invalidate: forget the cached data of a byte range of a
+ * device (to its end if length is 0; offset 0 and length 0 is all of
+ * it).  Invalidation is rare, so we just walk the LRU.
+ */
+static void fusd_cache_invalidate(fusd_dev_t *fusd_dev, loff_t offset, loff_t length)
+{
+	struct fusd_cache_page *cp, *next;
+	unsigned long first = offset >> PAGE_SHIFT;
+	unsigned long last = length ? (offset + length - 1) >> PAGE_SHIFT : ~0UL;
+	LIST_HEAD(stale);
+
+	spin_lock(&fusd_cache_lock);
+	fusd_dev->cache_gen++;
+	list_for_each_entry_safe(cp, next, &fusd_cache_lru, lru)
+		if (cp->fusd_dev == fusd_dev && cp->index >= first && cp->index <= last)
+			fusd_cache_remove(cp, &stale);
+	spin_unlock(&fusd_cache_lock);
+
+	fusd_cache_free_list(&stale);
+}
+
+/*
+ * fusd_cache_read: try to serve a read from the page cache.  Returns
+ * 1 if it was (*done is then the byte count or -EFAULT), 0 on a miss.
+ * A read that runs from cached pages into uncached ones is cut short.
+ */
+static int fusd_cache_read(fusd_dev_t *fusd_dev, char *buf, size_t count,
+                           loff_t pos, ssize_t *done)
+{
+	struct fusd_cache_page *cp;
+	struct page *page = NULL;
+	size_t copied = 0, n, want;
+	unsigned int off, len = 0;
+	int eof = 0;
+	char *kaddr;
+
+	while (copied < count && !eof) {
+		off = (pos + copied) & ~PAGE_MASK;
+
+		spin_lock(&fusd_cache_lock);
+		cp = radix_tree_lookup(&fusd_dev->page_cache, (pos + copied) >> PAGE_SHIFT);
+		if (cp != NULL) {
+			page = cp->page;
+			len = cp->len;
+			get_page(page);
+			list_move(&cp->lru, &fusd_cache_lru);
+		}
+		spin_unlock(&fusd_cache_lock);
+
+		if (cp == NULL)
+			break;
+
+		/* a short page is the end of the device */
+		eof = (len < PAGE_SIZE);
+		want = off < len ? min_t(size_t, len - off, count - copied) : 0;
+
+		kaddr = kmap(page);
+		n = want - copy_to_user(buf + copied, kaddr + off, want);
+		kunmap(page);
+		put_page(page);
+
+		copied += n;
+		if (n < want) {
+			*done = copied ? copied : -EFAULT;
+			return 1;
+		}
+	}
+
+	spin_lock(&fusd_cache_lock);
+	if (copied > 0 || eof)
+		fusd_dev->cache_hits++;
+	else
+		fusd_dev->cache_misses++;
+	spin_unlock(&fusd_cache_lock);
+
+	if (copied == 0 && !eof)
+		return 0;
+
+	*done = copied;
+	return 1;
+}
+
+/*
+ * fusd_cache_fill: cache the data a driver returned for a page-aligned
+ * read at 'pos', unless the cache was invalidated since we sent it
+ * (generation 'gen').  A partial last page is only cached if the read
+ * came back short, i.e. at the end of the device.
+ */
+static void fusd_cache_fill(fusd_dev_t *fusd_dev, unsigned long gen, loff_t pos,
+                            const char *data, size_t len, int eof)
+{
+	struct fusd_cache_page *cp;
+	unsigned long index = pos >> PAGE_SHIFT;
+	size_t done, n;
+	LIST_HEAD(unused);
+
+	for (done = 0; done < len; done += n, index++) {
+		n = min_t(size_t, len - done, PAGE_SIZE);
+		if (n < PAGE_SIZE && !eof)
+			break;
+
+		if ((cp = KMALLOC(sizeof(struct fusd_cache_page), GFP_KERNEL)) == NULL)
+			break;
+		if ((cp->page = alloc_page(GFP_KERNEL)) == NULL) {
+			KFREE(cp);
+			break;
+		}
+		cp->fusd_dev = fusd_dev;
+		cp->index = index;
+		cp->len = n;
+		memcpy(kmap(cp->page), data + done, n);
+		kunmap(cp->page);
+
+		if (radix_tree_preload(GFP_KERNEL)) {
+			list_add(&cp->lru, &unused);
+			break;
+		}
+
+		spin_lock(&fusd_cache_lock);
+		if (gen != fusd_dev->cache_gen ||
+		    radix_tree_insert(&fusd_dev->page_cache, index, cp) < 0) {
+			/* stale, or someone else cached it first */
+			list_add(&cp->lru, &unused);
+		} else {
+			list_add(&cp->lru, &fusd_cache_lru);
+			if (++fusd_cache_pages > FUSD_CACHE_MAX_PAGES)
+				fusd_cache_evict(fusd_cache_pages - FUSD_CACHE_MAX_PAGES, &unused);
+		}
+		spin_unlock(&fusd_cache_lock);
+		radix_tree_preload_end();
+	}
+
+	fusd_cache_free_list(&unused);
+}
+
+#ifdef CONFIG_FUSD_CACHE_SHRINKER
+static unsigned long fusd_cache_count(struct shrinker *shrinker,
+                                      struct shrink_control *sc)
+{
+	return fusd_cache_pages;
+}
+
+static unsigned long fusd_cache_scan(struct shrinker *shrinker,
+                                     struct shrink_control *sc)
+{
+	unsigned long freed;
+	LIST_HEAD(evicted);
+
+	spin_lock(&fusd_cache_lock);
+	freed = fusd_cache_evict(sc->nr_to_scan, &evicted);
+	spin_unlock(&fusd_cache_lock);
+
+	fusd_cache_free_list(&evicted);
+	return freed ? freed : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *fusd_cache_shrinker;
+#else
+static struct shrinker fusd_cache_shrinker_s = {
+	.count_objects = fusd_cache_count,
+	.scan_objects = fusd_cache_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+#endif
+
+static void fusd_cache_register_shrinker(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	if ((fusd_cache_shrinker = shrinker_alloc(0, "fusd-cache")) == NULL) {
+		printk(KERN_WARNING "fusd: can't allocate page cache shrinker\n");
+		return;
+	}
+	fusd_cache_shrinker->count_objects = fusd_cache_count;
+	fusd_cache_shrinker->scan_objects = fusd_cache_scan;
+	shrinker_register(fusd_cache_shrinker);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	register_shrinker(&fusd_cache_shrinker_s, "fusd-cache");
+#else
+	register_shrinker(&fusd_cache_shrinker_s);
+#endif
+}
+
+static void fusd_cache_unregister_shrinker(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	if (fusd_cache_shrinker != NULL)
+		shrinker_free(fusd_cache_shrinker);
+#else
+	unregister_shrinker(&fusd_cache_shrinker_s);
+#endif
+}
+#endif /* CONFIG_FUSD_CACHE_SHRINKER */
+
+
 /****************************************************************************/
 /********************** CLIENT CALLBACK FUNCTIONS ***************************/
 /****************************************************************************/
@@ -774,10 +1158,18 @@ static void fusd_forge_close(fusd_msg_t *msg, fusd_dev_t *fusd_dev)
  * fusd_fops_call_send: send a fusd_msg into userspace.
  *
  * NOTE - we are already holding the lock on fusd_file_arg when this
- * function is called, but NOT the lock on the fusd_dev
+ * function is called (except for polldiffs, sent lock-free by poll),
+ * but NOT the lock on the fusd_dev
  */
 static int fusd_fops_call_send(fusd_file_t *fusd_file_arg,
                                fusd_msg_t *fusd_msg, struct fusd_transaction **transaction)
+{
+	return __fusd_fops_call_send(fusd_file_arg, fusd_msg, transaction, 0);
+}
+
+/* same, but the caller may already hold the device lock */
+static int __fusd_fops_call_send(fusd_file_t *fusd_file_arg, fusd_msg_t *fusd_msg,
+                                 struct fusd_transaction **transaction, int locked)
 {
 	fusd_dev_t *fusd_dev;
 	fusd_file_t *fusd_file;
@@ -785,20 +1177,25 @@ static int fusd_fops_call_send(fusd_file_t *fusd_file_arg,
 	/* I check this just in case, shouldn't be necessary. */
 	GET_FUSD_FILE_AND_DEV(fusd_file_arg, fusd_file, fusd_dev);
 
-	/* make sure message is sane */
-	if ((fusd_msg->data == NULL) != (fusd_msg->datalen == 0)) {
+	/* make sure message is sane (no data pointer, but a length, means
+	 * the data is inline) */
+	if ((fusd_msg->data != NULL && fusd_msg->datalen == 0) ||
+	    (fusd_msg->data == NULL && fusd_msg->datalen > FUSD_INLINE_MAX)) {
 		RDEBUG(2, "fusd_fops_call: data pointer and datalen mismatch");
 		return -EINVAL;
 	}
 
 	/* fill the rest of the structure */
-	fusd_msg->parm.fops_msg.pid = current->pid;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 29)
-	fusd_msg->parm.fops_msg.uid = current_uid();
-	fusd_msg->parm.fops_msg.gid = current_gid();
-#endif
+	/* write-behind sends writes on behalf of whoever made them */
+	if (fusd_msg->parm.fops_msg.pid == 0) {
+		fusd_msg->parm.fops_msg.pid = current->pid;
+		fusd_msg->parm.fops_msg.uid = CURRENT_UID();
+		fusd_msg->parm.fops_msg.gid = CURRENT_GID();
+	}
 	fusd_msg->parm.fops_msg.flags = fusd_file->file->f_flags;
-	fusd_msg->parm.fops_msg.offset = fusd_file->file->f_pos;
+	/* reads and writes carry their own position (think pread) */
+	if (fusd_msg->subcmd != FUSD_READ && fusd_msg->subcmd != FUSD_WRITE)
+		fusd_msg->parm.fops_msg.offset = fusd_file->file->f_pos;
 	fusd_msg->parm.fops_msg.device_info = fusd_dev->private_data;
 	fusd_msg->parm.fops_msg.private_info = fusd_file->private_data;
 	fusd_msg->parm.fops_msg.fusd_file = fusd_file;
@@ -834,7 +1231,7 @@ static int fusd_fops_call_send(fusd_file_t *fusd_file_arg,
 	}
 
 	/* now add the message to the device's outgoing queue! */
-	return send_to_dev(fusd_dev, fusd_msg, 0);
+	return send_to_dev(fusd_dev, fusd_msg, locked);
 
 
 	/* bizarre errors go straight here */
@@ -852,6 +1249,14 @@ invalid_file:
  */
 static int fusd_fops_call_wait(fusd_file_t *fusd_file_arg,
                                fusd_msg_t **fusd_msg_reply, struct fusd_transaction *transaction)
+{
+	return __fusd_fops_call_wait(fusd_file_arg, fusd_msg_reply, transaction, 1);
+}
+
+/* same, but the caller may not hold the file lock (see fusd_fault_call);
+ * the file's flags and private data are then left as they are */
+static int __fusd_fops_call_wait(fusd_file_t *fusd_file_arg, fusd_msg_t **fusd_msg_reply,
+                                 struct fusd_transaction *transaction, int file_locked)
 {
 	fusd_dev_t *fusd_dev;
 	fusd_file_t *fusd_file;
@@ -872,17 +1277,19 @@ static int fusd_fops_call_wait(fusd_file_t *fusd_file_arg,
 	 * sleep condition and sleeping.
 	 */
 	LOCK_FUSD_DEV(fusd_dev);
+	transaction->waiting = 1;
 	while (transaction->msg_in == NULL) {
 		DECLARE_WAITQUEUE(wait, current);
 
 		RDEBUG(10, "pid %d blocking on transid %ld", current->pid, transaction->transid);
 		current->state = TASK_INTERRUPTIBLE;
-		add_wait_queue(&fusd_file->file_wait, &wait);
+		add_wait_queue(&transaction->wait, &wait);
 		UNLOCK_FUSD_DEV(fusd_dev);
-		UNLOCK_FUSD_FILE(fusd_file);
+		if (file_locked)
+			UNLOCK_FUSD_FILE(fusd_file);
 
 		schedule();
-		remove_wait_queue(&fusd_file->file_wait, &wait);
+		remove_wait_queue(&transaction->wait, &wait);
 		current->state = TASK_RUNNING;
 
 		/*
@@ -898,14 +1305,21 @@ static int fusd_fops_call_wait(fusd_file_t *fusd_file_arg,
 		if (signal_pending(current)) {
 			RDEBUG(5, "blocked pid %d got a signal; sending -ERESTARTSYS",
 			       current->pid);
-			LOCK_FUSD_FILE(fusd_file);
+			/* no more copies to or from us until we're back */
+			LOCK_FUSD_DEV(fusd_dev);
+			transaction->waiting = 0;
+			UNLOCK_FUSD_DEV(fusd_dev);
+			if (file_locked)
+				LOCK_FUSD_FILE(fusd_file);
 			return -ERESTARTSYS;
 		}
 
-		LOCK_FUSD_FILE(fusd_file);
+		if (file_locked)
+			LOCK_FUSD_FILE(fusd_file);
 		/* re-lock the device, so we can do our msg_in check again */
 		LOCK_FUSD_DEV(fusd_dev);
 	}
+	transaction->waiting = 0;
 	UNLOCK_FUSD_DEV(fusd_dev);
 
 	/* ok - at this point we are awake due to a message received. */
@@ -919,8 +1333,10 @@ static int fusd_fops_call_wait(fusd_file_t *fusd_file_arg,
 	}
 
 	/* copy metadata back from userspace */
-	fusd_file->file->f_flags = transaction->msg_in->parm.fops_msg.flags;
-	fusd_file->private_data = transaction->msg_in->parm.fops_msg.private_info;
+	if (file_locked) {
+		fusd_file->file->f_flags = transaction->msg_in->parm.fops_msg.flags;
+		fusd_file->private_data = transaction->msg_in->parm.fops_msg.private_info;
+	}
 	/* note, changes to device_info are NO LONGER honored here */
 
 	/* if everything's okay, return the return value.  if caller is
@@ -1072,6 +1488,9 @@ int fusd_dev_add_file(struct file *file, fusd_dev_t *fusd_dev, fusd_file_t **fus
 	init_waitqueue_head(&fusd_file->file_wait);
 	init_waitqueue_head(&fusd_file->poll_wait);
 	INIT_LIST_HEAD(&fusd_file->transactions);
+	spin_lock_init(&fusd_file->meta_lock);
+	spin_lock_init(&fusd_file->stream_lock);
+	FUSD_INIT_WORK(&fusd_file->wb_work, fusd_wb_work);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 30)
 	init_MUTEX(&fusd_file->file_sem);
 	init_MUTEX(&fusd_file->transactions_sem);
@@ -1079,7 +1498,9 @@ int fusd_dev_add_file(struct file *file, fusd_dev_t *fusd_dev, fusd_file_t **fus
 	sema_init(&fusd_file->file_sem, 1);
 	sema_init(&fusd_file->transactions_sem, 1);
 #endif
-	fusd_file->last_poll_sent = -1;
+	atomic_set(&fusd_file->cached_poll_state, 0);
+	atomic_set(&fusd_file->last_poll_sent, -1);
+	fusd_file->ra_next = -1;
 	fusd_file->magic = FUSD_FILE_MAGIC;
 	fusd_file->fusd_dev = fusd_dev;
 	fusd_file->fusd_dev_version = fusd_dev->version;
@@ -1114,6 +1535,94 @@ static struct fusd_dev_t_s *find_user_device(int dev_id)
 	return NULL;
 }
 
+/* the open cache slot for opens by uid with access mode accmode */
+#define FUSD_OPEN_VERDICT(fusd_dev, uid, accmode) \
+	(&(fusd_dev)->open_cache[((uid) * 4 + (accmode)) % FUSD_OPEN_CACHE_SIZE])
+
+/*
+ * DEVICE LOCK MUST BE HELD
+ *
+ * fusd_open_policy_check: evaluate the open policy the driver
+ * installed, if any, for the current process, opening with access
+ * mode accmode (f_flags & O_ACCMODE).  Returns:
+ *
+ *    1 - no verdict; ask the driver
+ *    0 - open allowed without asking the driver
+ *   <0 - open refused with that error, without asking the driver
+ */
+static int fusd_open_policy_check(fusd_dev_t *fusd_dev, uid_t uid, int accmode)
+{
+	fusd_open_policy_t *policy = fusd_dev->open_policy;
+	struct fusd_open_verdict *verdict;
+	uid_t *uids;
+	gid_t *gids;
+	int i, allowed;
+
+	if (policy == NULL)
+		return 1;
+
+	/* first, the static uid/gid sets */
+	if (policy->num_uids || policy->num_gids) {
+		uids = (uid_t *) (policy + 1);
+		gids = (gid_t *) (uids + policy->num_uids);
+		allowed = 0;
+
+		for (i = 0; i < policy->num_uids && !allowed; i++)
+			if (uids[i] == uid)
+				allowed = 1;
+		for (i = 0; i < policy->num_gids && !allowed; i++)
+			if (IN_GROUP(gids[i]))
+				allowed = 1;
+
+		if (!allowed) {
+			RDEBUG(3, "/dev/%s open policy refuses uid %d", NAME(fusd_dev), uid);
+			return -EPERM;
+		}
+		if (policy->flags & FUSD_POLICY_FINAL)
+			return 0;
+	}
+
+	/* then, whatever the driver told us last time this uid asked for
+	 * the same access: a driver may well let a uid read but not write */
+	if (fusd_dev->open_cache != NULL) {
+		verdict = FUSD_OPEN_VERDICT(fusd_dev, uid, accmode);
+		if (verdict->valid && verdict->uid == uid && verdict->accmode == accmode) {
+			if (policy->cache_ttl == 0 || time_before(jiffies, verdict->expires))
+				return verdict->retval;
+			verdict->valid = 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * DEVICE LOCK MUST BE HELD
+ *
+ * fusd_open_cache_store: remember the driver's answer to an open by
+ * uid with access mode accmode, if the policy asks for that.  Only success and permission
+ * errors are verdicts; anything else might be transient.  gen is the
+ * open_cache_gen seen before the driver was asked: if the cache was
+ * flushed since, the answer may predate the flush and is not kept.
+ */
+static void fusd_open_cache_store(fusd_dev_t *fusd_dev, uid_t uid, int accmode,
+                                  int retval, unsigned long gen)
+{
+	struct fusd_open_verdict *verdict;
+
+	if (fusd_dev->open_cache == NULL || gen != fusd_dev->open_cache_gen)
+		return;
+	if (retval != 0 && retval != -EPERM && retval != -EACCES)
+		return;
+
+	verdict = FUSD_OPEN_VERDICT(fusd_dev, uid, accmode);
+	verdict->valid = 1;
+	verdict->uid = uid;
+	verdict->accmode = accmode;
+	verdict->retval = retval;
+	verdict->expires = jiffies + msecs_to_jiffies(fusd_dev->open_policy->cache_ttl);
+}
+
 /*
  * A client has called open() has been called on a registered device.
  * See comment higher up for detailed notes on this function.
@@ -1126,6 +1635,8 @@ static int fusd_client_open(struct inode *inode, struct file *file)
 	fusd_file_t *fusd_file;
 	fusd_msg_t fusd_msg;
 	struct fusd_transaction *transaction;
+	uid_t uid = CURRENT_UID();
+	unsigned long cache_gen;
 
 	/* If the device wasn't on our valid list, stop here. */
 	if (!fusd_dev_is_valid(fusd_dev))
@@ -1165,19 +1676,37 @@ static int fusd_client_open(struct inode *inode, struct file *file)
 		return retval;
 	}
 
-	/* send message to userspace and get retval */
-	init_fusd_msg(&fusd_msg);
-	fusd_msg.subcmd = FUSD_OPEN;
+	/* the driver's open policy may already know the answer.  files
+	 * it lets in are never shown to the driver, not even on close. */
+	retval = fusd_open_policy_check(fusd_dev, uid, file->f_flags & O_ACCMODE);
+	if (retval == 0)
+		fusd_file->local_open = 1;
 
-	/* send message to userspace and get the reply.  Device can't be
-	 * locked during that operation. */
+	/* a driver without an open callback accepts every open; don't
+	 * bother it with the round trip */
+	if (retval > 0 && !FUSD_DEV_HAS(fusd_dev, FUSD_CAP_OPEN))
+		retval = 0;
 
-	UNLOCK_FUSD_DEV(fusd_dev);
-	retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction);
+	if (retval > 0) {
+		/* send message to userspace and get retval */
+		init_fusd_msg(&fusd_msg);
+		fusd_msg.subcmd = FUSD_OPEN;
 
-	if (retval >= 0)
-		retval = fusd_fops_call_wait(fusd_file, NULL, transaction);
-	RAWLOCK_FUSD_DEV(fusd_dev);
+		/* send message to userspace and get the reply.  Device can't be
+		 * locked during that operation. */
+
+		cache_gen = fusd_dev->open_cache_gen;
+		UNLOCK_FUSD_DEV(fusd_dev);
+		retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction);
+
+		if (retval >= 0)
+			retval = fusd_fops_call_wait(fusd_file, NULL, transaction);
+		RAWLOCK_FUSD_DEV(fusd_dev);
+
+		if (!ZOMBIE(fusd_dev))
+			fusd_open_cache_store(fusd_dev, uid, file->f_flags & O_ACCMODE,
+			                      retval, cache_gen);
+	}
 
 	/* If the device zombified (while we were waiting to reacquire the
 	 * lock)... consider that a failure */
@@ -1201,457 +1730,2502 @@ static int fusd_client_open(struct inode *inode, struct file *file)
 	return retval;
 }
 
-/* close() has been called on a registered device.  like
- * fusd_client_open, we must lock the entire device. */
-static int fusd_client_release(struct inode *inode, struct file *file)
+/*
+ * fusd_client_release_async: tell the driver that the file closed
+ * without waiting for it to answer.  The close goes out as a
+ * drop-reply message; the file stays in the device's file array
+ * (so replies still in flight find it) until the driver actually
+ * reads the close, at which point fusd_read frees it.
+ *
+ * Returns 0 if the file is now owned by the outgoing queue (or was
+ * freed), or a negative error if the close could not be sent; the
+ * caller then frees the file itself.
+ */
+static int fusd_client_release_async(fusd_dev_t *fusd_dev, fusd_file_t *fusd_file)
 {
-	int retval;
-	fusd_file_t *fusd_file;
-	fusd_dev_t *fusd_dev;
 	fusd_msg_t fusd_msg;
-	struct fusd_transaction *transaction;
-
-	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
-	LOCK_FUSD_FILE(fusd_file);
-
-	RDEBUG(3, "got a close on /dev/%s (owned by pid %d) from pid %d",
-	       NAME(fusd_dev), fusd_dev->pid, current->pid);
+	fusd_msgC_t *ptr;
+	int retval;
 
-	/* Tell the driver that the file closed, if it still exists. */
 	init_fusd_msg(&fusd_msg);
+	fusd_msg.cmd = FUSD_FOPS_CALL_DROPREPLY;
 	fusd_msg.subcmd = FUSD_CLOSE;
-	retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction);
-	RDEBUG(5, "fusd_client_release: send returned %d", retval);
-	if (retval >= 0)
-		retval = fusd_fops_call_wait(fusd_file, NULL, transaction);
+	if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, NULL)) < 0)
+		return retval;
 
-	RDEBUG(5, "fusd_client_release: call_wait %d", retval);
-	/* delete the file off the device's file-list, and free it.  note
-	 * that device may be a zombie right now and may be freed when we
-	 * come back from free_fusd_file.  we only release the lock if the
-	 * device still exists. */
 	RAWLOCK_FUSD_DEV(fusd_dev);
-	if (!free_fusd_file(fusd_dev, fusd_file)) {
-		UNLOCK_FUSD_DEV(fusd_dev);
+
+	/* the struct file is going away; make sure nothing mistakes the
+	 * next file allocated at that address for this one */
+	fusd_file->file = NULL;
+
+	/* the driver went away since we queued the close, and
+	 * fusd_drop_released_files has already been through the queue:
+	 * nobody would honour release_file */
+	if (ZOMBIE(fusd_dev)) {
+		if (!free_fusd_file(fusd_dev, fusd_file))
+			UNLOCK_FUSD_DEV(fusd_dev);
+		return 0;
 	}
 
-	return retval;
+	/* find our close in the queue.  if it's no longer there, the
+	 * driver already read it and we can let go right away. */
+	for (ptr = fusd_dev->msg_head; ptr != NULL; ptr = ptr->next) {
+		if (ptr->fusd_msg.subcmd == FUSD_CLOSE &&
+		    ptr->fusd_msg.parm.fops_msg.transid == fusd_msg.parm.fops_msg.transid) {
+			ptr->release_file = fusd_file;
+			UNLOCK_FUSD_DEV(fusd_dev);
+			return 0;
+		}
+	}
 
-invalid_dev:
-invalid_file:
-	RDEBUG(1, "got a close on client file from pid %d, INVALID DEVICE!",
-	       current->pid);
-	return -EPIPE;
+	if (!free_fusd_file(fusd_dev, fusd_file))
+		UNLOCK_FUSD_DEV(fusd_dev);
+	return 0;
 }
 
-static ssize_t fusd_client_read(struct file *file, char *buf,
-                                size_t count, loff_t *offset)
+/*
+ * DEVICE LOCK MUST BE HELD
+ *
+ * fusd_drop_released_files: the driver is gone and will never read
+ * the closes of asynchronously released files still in its queue.
+ * Free those files now.  Returns 1 if the device was freed as well
+ * (in which case, do not unlock it).
+ */
+static int fusd_drop_released_files(fusd_dev_t *fusd_dev)
 {
-	fusd_dev_t *fusd_dev;
+	fusd_msgC_t *ptr;
 	fusd_file_t *fusd_file;
-	struct fusd_transaction *transaction;
-	fusd_msg_t fusd_msg, *reply = NULL;
-	int retval = -EPIPE;
-
-	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
 
-	if (ZOMBIE(fusd_dev))
-		goto zombie_dev;
+	for (ptr = fusd_dev->msg_head; ptr != NULL; ptr = ptr->next) {
+		if ((fusd_file = ptr->release_file) != NULL) {
+			ptr->release_file = NULL;
+			if (free_fusd_file(fusd_dev, fusd_file))
+				return 1;
+		}
+	}
+	return 0;
+}
 
-	LOCK_FUSD_FILE(fusd_file);
+/*
+ * Write-behind.  Devices that set FUSD_DEV_WRITE_BEHIND have client
+ * writes copied into a buffer, and the write returns right away.  The
+ * buffer is sent to the driver as one write message, at most one at a
+ * time per file: while one is in flight, further writes pile up in the
+ * next buffer, so a chatty writer ends up sending a few large writes
+ * instead of many small ones.  When the driver replies, wb_work sends
+ * whatever accumulated in the meantime.
+ *
+ * FUSD_DEV_COALESCE goes further for clients making lots of tiny
+ * writes: a small write made while nothing is in flight is held back
+ * (Nagle-style, for coalesce_delay at most) in case more follow, and
+ * writes made while the previous write message still sits in the
+ * device's queue, unread by the driver, are appended to it.
+ *
+ * The driver's verdict can't be returned by the write that made it,
+ * so an error (including a short write) is kept and returned by the
+ * next write or fsync.  fsync and close wait until the driver has
+ * replied to everything.
+ *
+ * FILE LOCK MUST BE HELD for all of these but wb_work
+ */
 
-	RDEBUG(3, "got a read on /dev/%s (owned by pid %d) from pid %d",
-	       NAME(fusd_dev), fusd_dev->pid, current->pid);
+/* send the buffered data.  there must not be a write in flight.
+ * Without 'reply', the driver's answer is dropped and the write is not
+ * tracked at all (for close, when nobody is left to hear it). */
+static int __fusd_wb_start(fusd_file_t *fusd_file, int reply)
+{
+	fusd_msg_t fusd_msg;
+	int retval;
 
-	transaction = fusd_find_incomplete_transaction(fusd_file, FUSD_READ);
-	if (transaction && transaction->size > count) {
-		RDEBUG(2,
-		       "Incomplete I/O transaction %ld thrown out, as the transaction's size of %d bytes was greater than "
-		       "the retry's size of %d bytes", transaction->transid, transaction->size, (int) count);
+	if (fusd_file->wb_len == 0)
+		return 0;
 
-		fusd_cleanup_transaction(fusd_file, transaction);
-		transaction = NULL;
+	init_fusd_msg(&fusd_msg);
+	if (!reply)
+		fusd_msg.cmd = FUSD_FOPS_CALL_DROPREPLY;
+	fusd_msg.subcmd = FUSD_WRITE;
+	fusd_msg.data = fusd_file->wb_buf;
+	fusd_msg.datalen = fusd_file->wb_len;
+	fusd_msg.parm.fops_msg.length = fusd_file->wb_len;
+	fusd_msg.parm.fops_msg.offset = fusd_file->wb_pos;
+	fusd_msg.parm.fops_msg.pid = fusd_file->wb_pid;
+	fusd_msg.parm.fops_msg.uid = fusd_file->wb_uid;
+	fusd_msg.parm.fops_msg.gid = fusd_file->wb_gid;
+
+	if (!reply) {
+		if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, NULL)) < 0)
+			return retval;
+		fusd_file->wb_buf = NULL;
+		fusd_file->wb_len = 0;
+		fusd_file->wb_nwrites = 0;
+		return 0;
 	}
 
-	if (transaction == NULL) {
-		/* make sure we aren't trying to read too big of a buffer */
-		if (count > MAX_RW_SIZE)
-			count = MAX_RW_SIZE;
+	if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, &fusd_file->wb_transaction)) < 0) {
+		fusd_file->wb_transaction = NULL;
+		return retval;
+	}
 
-		/* send the message */
-		init_fusd_msg(&fusd_msg);
-		fusd_msg.subcmd = FUSD_READ;
-		fusd_msg.parm.fops_msg.length = count;
+	RAWLOCK_FUSD_DEV(fusd_file->fusd_dev);
+	fusd_file->fusd_dev->wb_writes += fusd_file->wb_nwrites;
+	fusd_file->fusd_dev->wb_msgs++;
+	UNLOCK_FUSD_DEV(fusd_file->fusd_dev);
 
-		/* send message to userspace */
-		if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction)) < 0)
-			goto done;
-	}
+	/* nobody's syscall is waiting for this one: keep the restart logic
+	 * (which goes by pid) from mistaking it for theirs */
+	fusd_file->wb_transaction->async = 1;
 
-	/* and wait for the reply */
-	/* todo: store and retrieve the transid from the interrupted messsage */
-	retval = fusd_fops_call_wait(fusd_file, &reply, transaction);
+	/* the buffer now belongs to the message */
+	fusd_file->wb_sent = fusd_file->wb_len;
+	fusd_file->wb_buf = NULL;
+	fusd_file->wb_len = 0;
+	fusd_file->wb_nwrites = 0;
+	return 0;
+}
 
-	/* return immediately in case of error */
-	if (retval < 0 || reply == NULL)
-		goto done;
+static int fusd_wb_start(fusd_file_t *fusd_file)
+{
+	return __fusd_wb_start(fusd_file, 1);
+}
 
-	/* adjust the reval if the retval indicates a larger read than the
-	 * data that was actually provided */
-	if (reply->datalen != retval) {
-		RDEBUG(1, "warning: /dev/%s driver (pid %d) claimed it returned %d bytes "
-		          "on read but actually returned %d",
-		       NAME(fusd_dev), fusd_dev->pid, retval, reply->datalen);
-		retval = reply->datalen;
-	}
+/* start a write nobody is waiting for.  If it can't be sent, the
+ * error goes where the driver's would have, and the data is dropped:
+ * the next write or fsync reports it as lost. */
+static void fusd_wb_start_async(fusd_file_t *fusd_file)
+{
+	int retval;
 
-	/* adjust if the device driver gave us more data than the user asked for
-	 *     (bad!  bad!  why is the driver broken???) */
-	if (retval > count) {
-		RDEBUG(1, "warning: /dev/%s driver (pid %d) returned %d bytes on read but "
-		          "the user only asked for %d",
-		       NAME(fusd_dev), fusd_dev->pid, retval, (int) count);
-		retval = count;
+	if ((retval = fusd_wb_start(fusd_file)) < 0) {
+		RDEBUG(2, "/dev/%s: write-behind couldn't send %d bytes: %d",
+		       NAME(fusd_file->fusd_dev), fusd_file->wb_len, retval);
+		if (fusd_file->wb_error == 0)
+			fusd_file->wb_error = retval;
+		fusd_file->wb_len = 0;
+		fusd_file->wb_nwrites = 0;
 	}
+}
 
-	/* copy the offset back from the message */
-	*offset = reply->parm.fops_msg.offset;
+/* append the buffered data to the write in flight, if the driver
+ * hasn't read it yet and it's contiguous.  its data buffer was one of
+ * ours, so it has room for FUSD_WB_SIZE bytes. */
+static void fusd_wb_merge(fusd_file_t *fusd_file)
+{
+	fusd_dev_t *fusd_dev = fusd_file->fusd_dev;
+	struct fusd_transaction *transaction = fusd_file->wb_transaction;
+	fusd_msgC_t *ptr;
+	fusd_msg_t *msg;
 
-	/* IFF return value indicates data present, copy it back */
-	if (retval > 0) {
-		if (copy_to_user(buf, reply->data, retval)) {
-			retval = -EFAULT;
-			goto done;
-		}
-	}
+	if (transaction == NULL || fusd_file->wb_len == 0)
+		return;
 
-done:
-	/* clear the readable bit of our cached poll state */
-	fusd_file->cached_poll_state &= ~(FUSD_NOTIFY_INPUT);
+	RAWLOCK_FUSD_DEV(fusd_dev);
+	for (ptr = fusd_dev->msg_head; ptr != NULL; ptr = ptr->next)
+		if (ptr->fusd_msg.subcmd == FUSD_WRITE &&
+		    ptr->fusd_msg.parm.fops_msg.transid == transaction->transid)
+			break;
 
-	free_fusd_msg(&reply);
-	UNLOCK_FUSD_FILE(fusd_file);
-	return retval;
+	/* too late, the driver has it -- or has read its header, and
+	 * expects the data to be as long as that said.  What's buffered
+	 * goes in a write of its own, once this one's done. */
+	if (ptr == NULL || ptr->peeked)
+		goto out;
 
-invalid_file:
-invalid_dev:
-zombie_dev:
-	RDEBUG(3, "got a read on client file from pid %d, driver has disappeared",
-	       current->pid);
-	return -EPIPE;
+	msg = &ptr->fusd_msg;
+	if (msg->parm.fops_msg.offset + msg->datalen != fusd_file->wb_pos ||
+	    msg->datalen + fusd_file->wb_len > FUSD_WB_SIZE)
+		goto out;
+
+	memcpy(msg->data + msg->datalen, fusd_file->wb_buf, fusd_file->wb_len);
+	msg->datalen += fusd_file->wb_len;
+	msg->parm.fops_msg.length += fusd_file->wb_len;
+	transaction->size += fusd_file->wb_len;
+	fusd_file->wb_sent += fusd_file->wb_len;
+	fusd_dev->wb_writes += fusd_file->wb_nwrites;
+
+	RDEBUG(5, "/dev/%s: merged %d bytes into queued write, now %d", NAME(fusd_dev),
+	       fusd_file->wb_len, msg->datalen);
+	fusd_file->wb_len = 0;
+	fusd_file->wb_nwrites = 0;
+
+out:
+	UNLOCK_FUSD_DEV(fusd_dev);
 }
 
-static int fusd_add_transaction(fusd_file_t *fusd_file, int transid, int subcmd, int size,
-                                struct fusd_transaction **out_transaction)
+/* collect the reply to the write in flight, if any.  Without 'block',
+ * returns -EAGAIN if it hasn't come in yet.
+ *
+ * Several callers may wait for the same reply (writers, fsync,
+ * wb_work), so they don't sleep in fusd_fops_call_wait, which frees
+ * the transaction: they wait on file_wait for wb_done, and whoever
+ * gets the file lock first collects the reply, without sleeping. */
+static int fusd_wb_reap(fusd_file_t *fusd_file, int block)
 {
-	struct fusd_transaction *transaction = (struct fusd_transaction *) KMALLOC(sizeof(struct fusd_transaction),
-	                                                                           GFP_KERNEL);
-	if (transaction == NULL)
-		return -ENOMEM;
-
-	transaction->msg_in = NULL;
-	transaction->transid = transid;
-	transaction->subcmd = subcmd;
-	transaction->pid = current->pid;
-	transaction->size = size;
+	fusd_dev_t *fusd_dev = fusd_file->fusd_dev;
+	int retval;
 
-	down(&fusd_file->transactions_sem);
-	list_add_tail(&transaction->list, &fusd_file->transactions);
-	up(&fusd_file->transactions_sem);
+	while (fusd_file->wb_transaction != NULL && !fusd_file->wb_done &&
+	       !ZOMBIE(fusd_dev)) {
+		if (!block)
+			return -EAGAIN;
 
-	if (out_transaction != NULL)
-		*out_transaction = transaction;
+		UNLOCK_FUSD_FILE(fusd_file);
+		retval = wait_event_interruptible(fusd_file->file_wait,
+		                                  fusd_file->wb_transaction == NULL ||
+		                                  fusd_file->wb_done || ZOMBIE(fusd_dev));
+		LOCK_FUSD_FILE(fusd_file);
+		if (retval)
+			return -ERESTARTSYS;
+	}
+	if (fusd_file->wb_transaction == NULL)
+		return 0;
 
+	/* the reply is in (or will never come, in which case this fails
+	 * right away) */
+	retval = fusd_fops_call_wait(fusd_file, NULL, fusd_file->wb_transaction);
+	fusd_file->wb_transaction = NULL;
+	fusd_file->wb_done = 0;
+	if (retval >= 0 && retval < fusd_file->wb_sent)
+		retval = -EIO;
+	if (retval < 0 && fusd_file->wb_error == 0)
+		fusd_file->wb_error = retval;
 	return 0;
 }
 
-static void fusd_cleanup_transaction(fusd_file_t *fusd_file, struct fusd_transaction *transaction)
+/* send everything and wait for the driver to have it */
+static int fusd_wb_flush(fusd_file_t *fusd_file)
 {
-	free_fusd_msg(&transaction->msg_in);
-	fusd_remove_transaction(fusd_file, transaction);
+	int retval;
+
+	if ((retval = fusd_wb_reap(fusd_file, 1)) < 0)
+		return retval;
+	if ((retval = fusd_wb_start(fusd_file)) < 0)
+		return retval;
+	return fusd_wb_reap(fusd_file, 1);
 }
 
-static void fusd_remove_transaction(fusd_file_t *fusd_file, struct fusd_transaction *transaction)
+/* return (and forget) the error a write in the background ran into */
+static int fusd_wb_error(fusd_file_t *fusd_file)
 {
-	down(&fusd_file->transactions_sem);
-	list_del(&transaction->list);
-	up(&fusd_file->transactions_sem);
+	int retval = fusd_file->wb_error;
 
-	KFREE(transaction);
+	fusd_file->wb_error = 0;
+	return retval;
 }
 
-static struct fusd_transaction *fusd_find_transaction(fusd_file_t *fusd_file, int transid)
+/* a write-behind write got its reply (see fusd_fops_reply), or small
+ * writes have been held back long enough */
+static void fusd_wb_work(struct work_struct *work)
 {
-	struct list_head *i;
-	down(&fusd_file->transactions_sem);
+	fusd_file_t *fusd_file = container_of(FUSD_DELAYED_WORK(work), fusd_file_t, wb_work);
 
-	list_for_each(i, &fusd_file->transactions)
-	{
-		struct fusd_transaction *transaction = list_entry(i,
-		struct fusd_transaction, list);
-		if (transaction->transid == transid) {
-			up(&fusd_file->transactions_sem);
-			return transaction;
-		}
-	}
-	up(&fusd_file->transactions_sem);
-	return NULL;
+	LOCK_FUSD_FILE(fusd_file);
+	if (fusd_wb_reap(fusd_file, 0) == 0 && fusd_file->wb_transaction == NULL)
+		fusd_wb_start_async(fusd_file);
+	UNLOCK_FUSD_FILE(fusd_file);
+
+	fusd_notify_readiness(fusd_file, FUSD_NOTIFY_OUTPUT);
 }
 
-static struct fusd_transaction *fusd_find_transaction_by_pid(fusd_file_t *fusd_file, int pid)
+/* a client write on a write-behind device.  Returns -ENOSPC if it's
+ * too big to buffer, and should be sent like any other write. */
+static ssize_t fusd_wb_write(fusd_file_t *fusd_file, struct file *file,
+                             const char *buffer, size_t length, loff_t *offset)
 {
-	struct list_head *i;
-	down(&fusd_file->transactions_sem);
+	fusd_dev_t *fusd_dev = fusd_file->fusd_dev;
+	ssize_t retval;
 
-	list_for_each(i, &fusd_file->transactions)
-	{
-		struct fusd_transaction *transaction = list_entry(i,
-		struct fusd_transaction, list);
-		if (transaction->pid == pid) {
-			up(&fusd_file->transactions_sem);
-			return transaction;
-		}
+	fusd_readahead_drop(fusd_file);
+	fusd_wb_reap(fusd_file, 0);
+	if ((retval = fusd_wb_error(fusd_file)) < 0)
+		return retval;
+
+	/* buffers are only ever contiguous: send what's there if this
+	 * write doesn't follow it, or doesn't fit */
+	if (fusd_file->wb_len > 0 &&
+	    (*offset != fusd_file->wb_pos + fusd_file->wb_len ||
+	     length > FUSD_WB_SIZE - fusd_file->wb_len)) {
+		if (fusd_file->wb_transaction != NULL && (file->f_flags & O_NONBLOCK))
+			return -EAGAIN;
+		if ((retval = fusd_wb_reap(fusd_file, 1)) < 0)
+			return retval;
+		if ((retval = fusd_wb_start(fusd_file)) < 0)
+			return retval;
 	}
-	up(&fusd_file->transactions_sem);
-	return NULL;
+
+	if (length > FUSD_WB_SIZE) {
+		if ((retval = fusd_wb_reap(fusd_file, 1)) < 0)
+			return retval;
+		if ((retval = fusd_wb_error(fusd_file)) < 0)
+			return retval;
+		return -ENOSPC;
+	}
+
+	if (fusd_file->wb_buf == NULL &&
+	    (fusd_file->wb_buf = VMALLOC(FUSD_WB_SIZE)) == NULL)
+		return -ENOMEM;
+	if (copy_from_user(fusd_file->wb_buf + fusd_file->wb_len, buffer, length))
+		return -EFAULT;
+
+	if (fusd_file->wb_len == 0)
+		fusd_file->wb_pos = *offset;
+	fusd_file->wb_len += length;
+	fusd_file->wb_nwrites++;
+	fusd_file->wb_pid = current->pid;
+	fusd_file->wb_uid = CURRENT_UID();
+	fusd_file->wb_gid = CURRENT_GID();
+	*offset += length;
+
+	/* what was cached of the range written is now stale */
+	if (fusd_dev->flags & FUSD_DEV_PAGE_CACHE)
+		fusd_cache_invalidate(fusd_dev, *offset - length, length);
+
+	/* nothing in flight: send it now, later writes will batch up
+	 * behind it -- unless it's small and we may wait for company */
+	if (fusd_file->wb_transaction != NULL) {
+		if (fusd_dev->flags & FUSD_DEV_COALESCE)
+			fusd_wb_merge(fusd_file);
+	} else if ((fusd_dev->flags & FUSD_DEV_COALESCE) && fusd_dev->coalesce_delay > 0 &&
+	           fusd_file->wb_len < FUSD_WB_SIZE / 4) {
+		schedule_delayed_work(&fusd_file->wb_work, fusd_dev->coalesce_delay);
+	} else {
+		fusd_wb_start_async(fusd_file);
+	}
+
+	return length;
 }
 
-static ssize_t fusd_client_write(struct file *file,
-                                 const char *buffer,
-                                 size_t length,
-                                 loff_t *offset)
+/* close() has been called on a registered device.  like
+ * fusd_client_open, we must lock the entire device. */
+static int fusd_client_release(struct inode *inode, struct file *file)
 {
-	fusd_dev_t *fusd_dev;
+	int retval;
 	fusd_file_t *fusd_file;
+	fusd_dev_t *fusd_dev;
 	fusd_msg_t fusd_msg;
-	fusd_msg_t *reply = NULL;
-	int retval = -EPIPE;
 	struct fusd_transaction *transaction;
+	int wb_retval = 0;
 
 	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
-
-	if (ZOMBIE(fusd_dev))
-		goto zombie_dev;
-
 	LOCK_FUSD_FILE(fusd_file);
 
-	RDEBUG(3, "got a write on /dev/%s (owned by pid %d) from pid %d",
+	RDEBUG(3, "got a close on /dev/%s (owned by pid %d) from pid %d",
 	       NAME(fusd_dev), fusd_dev->pid, current->pid);
 
-	transaction = fusd_find_incomplete_transaction(fusd_file, FUSD_WRITE);
-	if (transaction && transaction->size != length) {
-		RDEBUG(2,
-		       "Incomplete I/O transaction %ld thrown out, as the transaction's size of %d bytes was not equal to "
-		       "the retry's size of %d bytes", transaction->transid, transaction->size, (int) length);
+	/* deliver what's left of the writes we buffered, then make sure
+	 * no reply can start wb_work on this file anymore */
+	if (fusd_file->wb_len > 0 || fusd_file->wb_transaction != NULL) {
+		if ((wb_retval = fusd_wb_flush(fusd_file)) == 0)
+			wb_retval = fusd_wb_error(fusd_file);
+		RAWLOCK_FUSD_DEV(fusd_dev);
+		fusd_file->wb_transaction = NULL;
+		fusd_file->wb_done = 0;
+		UNLOCK_FUSD_DEV(fusd_dev);
 
-		fusd_cleanup_transaction(fusd_file, transaction);
-		transaction = NULL;
+		/* the flush was interrupted (or couldn't send): the driver
+		 * still gets what's left, but can't tell us how it went */
+		if (fusd_file->wb_len > 0 && __fusd_wb_start(fusd_file, 0) < 0)
+			RDEBUG(2, "/dev/%s: dropping %d buffered bytes on close",
+			       NAME(fusd_dev), fusd_file->wb_len);
+		if (wb_retval < 0)
+			RDEBUG(3, "/dev/%s: write-behind failed at close: %d",
+			       NAME(fusd_dev), wb_retval);
 	}
-	if (transaction == NULL) {
-		if (length < 0) {
-			RDEBUG(2, "fusd_client_write: got invalid length %d", (int) length);
-			retval = -EINVAL;
-			goto done;
-		}
-
-		if (length > MAX_RW_SIZE)
-			length = MAX_RW_SIZE;
+	UNLOCK_FUSD_FILE(fusd_file);
+	FUSD_CANCEL_WORK(&fusd_file->wb_work);
+	LOCK_FUSD_FILE(fusd_file);
 
+	/* Tell the driver that the file closed, if it still exists and
+	 * cares. */
+	retval = 0;
+	if (fusd_file->local_open) {
+		/* the driver never saw the open; don't show it the close */
+	} else if (FUSD_DEV_HAS(fusd_dev, FUSD_CAP_CLOSE) &&
+	           (fusd_dev->flags & FUSD_DEV_ASYNC_CLOSE)) {
+		if ((retval = fusd_client_release_async(fusd_dev, fusd_file)) == 0)
+			return 0;
+		/* couldn't queue the close; the driver is probably gone */
+	} else if (FUSD_DEV_HAS(fusd_dev, FUSD_CAP_CLOSE)) {
 		init_fusd_msg(&fusd_msg);
-
-		/* sigh.. i guess zero length writes should be legal */
-		if (length > 0) {
-			if ((fusd_msg.data = VMALLOC(length)) == NULL) {
-				retval = -ENOMEM;
-				goto done;
-			}
-
-			if (copy_from_user(fusd_msg.data, buffer, length)) {
-				retval = -EFAULT;
-				goto done;
-			}
-			fusd_msg.datalen = length;
-		}
-
-		fusd_msg.subcmd = FUSD_WRITE;
-		fusd_msg.parm.fops_msg.length = length;
-
-		if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction)) < 0)
-			goto done;
+		fusd_msg.subcmd = FUSD_CLOSE;
+		retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction);
+		RDEBUG(5, "fusd_client_release: send returned %d", retval);
+		if (retval >= 0)
+			retval = fusd_fops_call_wait(fusd_file, NULL, transaction);
 	}
-	/* todo: fix transid on restart */
-	retval = fusd_fops_call_wait(fusd_file, &reply, transaction);
 
-	if (retval < 0 || reply == NULL)
-		goto done;
+	RDEBUG(5, "fusd_client_release: call_wait %d", retval);
+	if (retval >= 0 && wb_retval < 0)
+		retval = wb_retval;
 
-	/* drivers should not write more bytes than they were asked to! */
-	if (retval > length) {
-		RDEBUG(1, "warning: /dev/%s driver (pid %d) returned %d bytes on write; "
-		          "the user only wanted %d",
-		       NAME(fusd_dev), fusd_dev->pid, retval, (int) length);
-		retval = length;
+	/* delete the file off the device's file-list, and free it.  note
+	 * that device may be a zombie right now and may be freed when we
+	 * come back from free_fusd_file.  we only release the lock if the
+	 * device still exists. */
+	RAWLOCK_FUSD_DEV(fusd_dev);
+	if (!free_fusd_file(fusd_dev, fusd_file)) {
+		UNLOCK_FUSD_DEV(fusd_dev);
 	}
 
-	*offset = reply->parm.fops_msg.offset;
-
-	/* all done! */
-
-done:
-	/* clear the writable bit of our cached poll state */
-	fusd_file->cached_poll_state &= ~(FUSD_NOTIFY_OUTPUT);
-
-	free_fusd_msg(&reply);
-	UNLOCK_FUSD_FILE(fusd_file);
 	return retval;
 
-invalid_file:
 invalid_dev:
-zombie_dev:
-	RDEBUG(3, "got a write on client file from pid %d, driver has disappeared",
+invalid_file:
+	RDEBUG(1, "got a close on client file from pid %d, INVALID DEVICE!",
 	       current->pid);
 	return -EPIPE;
 }
 
-#ifndef HAVE_UNLOCKED_IOCTL
-static int fusd_client_ioctl(struct inode *inode, struct file *file,
-                             unsigned int cmd, unsigned long arg)
-#else
-static long fusd_client_unlocked_ioctl (struct file *file,
-			      unsigned int cmd, unsigned long arg)
-#endif
+/*
+ * fusd_poll_state_clear: atomically clear bits of the cached poll
+ * state of a file, leaving a polldiff error (-1) alone.  Poll reads
+ * the state without any lock, so it must never see a torn update.
+ */
+static void fusd_poll_state_clear(fusd_file_t *fusd_file, int bits)
+{
+	int old_state;
+
+	do {
+		old_state = atomic_read(&fusd_file->cached_poll_state);
+		if (old_state < 0 || !(old_state & bits))
+			return;
+	} while (atomic_cmpxchg(&fusd_file->cached_poll_state, old_state,
+	                        old_state & ~bits) != old_state);
+}
+
+/*
+ * fusd_nonblock_cached: for devices that asked for it, decide an
+ * O_NONBLOCK read or write from the cached poll state alone.  Returns
+ * -EAGAIN if the file isn't known to be ready, 0 to go ask the driver.
+ * A polldiff is dispatched if needed so that the state gets refreshed.
+ * Done before taking the file lock: a non-blocking caller shouldn't
+ * queue up behind someone else's round trip just to be told "later".
+ */
+static int fusd_nonblock_cached(fusd_file_t *fusd_file, struct file *file, int bit)
+{
+	fusd_dev_t *fusd_dev = fusd_file->fusd_dev;
+	int poll_state;
+
+	if (!(file->f_flags & O_NONBLOCK) ||
+	    !(fusd_dev->flags & FUSD_DEV_NONBLOCK_CACHED))
+		return 0;
+
+	/* the driver told us it can't answer polls: ask it */
+	if ((poll_state = atomic_read(&fusd_file->cached_poll_state)) < 0)
+		return 0;
+
+	if (poll_state & bit)
+		return 0;
+	if (bit == FUSD_NOTIFY_INPUT && fusd_file->ra_len > 0)
+		return 0;
+
+	fusd_send_polldiff(fusd_file, 0);
+	return -EAGAIN;
+}
+
+/*
+ * Streams.  A driver producing a stream (think logs, sensor data)
+ * can set FUSD_DEV_STREAM and push data into a ring kept for each
+ * file instead of answering reads: clients then read from the ring,
+ * and poll it, like a pipe, without ever waiting for the driver.  When
+ * a client has read the ring down to FUSD_STREAM_LOW_MARK, the driver
+ * is sent a FUSD_STREAM_LOW message (if it has a callback for it) so
+ * that it can push more.
+ *
+ * Pushes come in with the device lock held and readers hold the file
+ * lock; stream_lock only protects the head and length.  The pusher
+ * only writes to the free part of the ring and the reader only reads
+ * the used part, so the copies themselves are done without it.
+ */
+static void fusd_stream_low(fusd_file_t *fusd_file, int len)
+{
+	fusd_msg_t fusd_msg;
+
+	if (len >= FUSD_STREAM_LOW_MARK || fusd_file->stream_low_sent ||
+	    fusd_file->stream_eof || !FUSD_DEV_HAS(fusd_file->fusd_dev, FUSD_CAP_STREAM_LOW))
+		return;
+
+	init_fusd_msg(&fusd_msg);
+	fusd_msg.cmd = FUSD_FOPS_CALL_DROPREPLY;
+	fusd_msg.subcmd = FUSD_STREAM_LOW;
+	fusd_msg.parm.fops_msg.length = FUSD_STREAM_SIZE - len;
+	if (fusd_fops_call_send(fusd_file, &fusd_msg, NULL) >= 0)
+		fusd_file->stream_low_sent = 1;
+}
+
+/* copy read data out to the client, or to a kernel buffer (for
+ * splice).  Returns nonzero if it faulted. */
+static inline int fusd_copy_out(char *dst, const char *src, size_t n, int to_kernel)
+{
+	if (to_kernel) {
+		memcpy(dst, src, n);
+		return 0;
+	}
+	return copy_to_user(dst, src, n) != 0;
+}
+
+/* read from a file's stream ring, waiting for a push if it's empty */
+static ssize_t fusd_stream_read(fusd_file_t *fusd_file, struct file *file,
+                                char *buf, size_t count, int to_kernel)
+{
+	fusd_dev_t *fusd_dev = fusd_file->fusd_dev;
+	int head, len, first;
+	ssize_t retval = 0;
+
+	LOCK_FUSD_FILE(fusd_file);
+	for (;;) {
+		spin_lock(&fusd_file->stream_lock);
+		head = fusd_file->stream_head;
+		len = fusd_file->stream_len;
+		spin_unlock(&fusd_file->stream_lock);
+
+		if (len > 0 || fusd_file->stream_eof || count == 0)
+			break;
+		if (ZOMBIE(fusd_dev)) {
+			retval = -EPIPE;
+			goto out;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			retval = -EAGAIN;
+			goto out;
+		}
+
+		/* ask for data, and wait for it without holding up other
+		 * readers' wakeups */
+		fusd_stream_low(fusd_file, 0);
+		UNLOCK_FUSD_FILE(fusd_file);
+		if (wait_event_interruptible(fusd_file->file_wait,
+		                             fusd_file->stream_len > 0 || fusd_file->stream_eof ||
+		                             ZOMBIE(fusd_dev)))
+			return -ERESTARTSYS;
+		LOCK_FUSD_FILE(fusd_file);
+	}
+
+	retval = min_t(size_t, count, len);
+	if (retval == 0)
+		goto out;
+
+	first = min_t(int, retval, FUSD_STREAM_SIZE - head);
+	if (fusd_copy_out(buf, fusd_file->stream_buf + head, first, to_kernel) ||
+	    fusd_copy_out(buf + first, fusd_file->stream_buf, retval - first, to_kernel)) {
+		retval = -EFAULT;
+		goto out;
+	}
+
+	spin_lock(&fusd_file->stream_lock);
+	fusd_file->stream_head = (head + retval) % FUSD_STREAM_SIZE;
+	fusd_file->stream_len -= retval;
+	len = fusd_file->stream_len;
+	spin_unlock(&fusd_file->stream_lock);
+
+	fusd_stream_low(fusd_file, len);
+
+out:
+	UNLOCK_FUSD_FILE(fusd_file);
+	return retval;
+}
+
+/*
+ * push data into one file's stream ring: all of it, or -EAGAIN if
+ * there isn't room for all of it.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_file_stream_push(fusd_file_t *fusd_file, const char *data, int len,
+                                 int eof)
+{
+	int tail, first;
+
+	if (fusd_file->stream_buf == NULL && len > 0) {
+		char *ring = VMALLOC(FUSD_STREAM_SIZE);
+
+		if (ring == NULL)
+			return -ENOMEM;
+		fusd_file->stream_buf = ring;
+	}
+
+	spin_lock(&fusd_file->stream_lock);
+	if (FUSD_STREAM_SIZE - fusd_file->stream_len < len) {
+		spin_unlock(&fusd_file->stream_lock);
+		return -EAGAIN;
+	}
+
+	tail = (fusd_file->stream_head + fusd_file->stream_len) % FUSD_STREAM_SIZE;
+	first = min(len, FUSD_STREAM_SIZE - tail);
+	memcpy(fusd_file->stream_buf + tail, data, first);
+	memcpy(fusd_file->stream_buf, data + first, len - first);
+	fusd_file->stream_len += len;
+	fusd_file->stream_eof = eof;
+	fusd_file->stream_low_sent = 0;
+	spin_unlock(&fusd_file->stream_lock);
+
+	wake_up_interruptible(&fusd_file->file_wait);
+	fusd_notify_readiness(fusd_file, FUSD_NOTIFY_INPUT);
+	return 0;
+}
+
+/*
+ * Read-ahead.  Clients often read sequentially with small buffers,
+ * each read costing a round trip.  Once a file's reads have been
+ * sequential (each starting where the previous one ended), we ask the
+ * driver for a whole window instead, hand the client what it asked
+ * for and keep the rest (the reply message itself) for the reads that
+ * follow.  The window doubles every time its data is used up and is
+ * halved when the client seeks away from it, up to the driver's
+ * ra_max.  It's off (ra_max 0) unless the driver turns it on, since
+ * reading more than asked isn't harmless for every device.
+ *
+ * Drivers that don't advance the offset (streams) get the same
+ * offset back until the buffered data runs out.
+ *
+ * What was read ahead is dropped when the file is written to or gets
+ * an ioctl, and (ra_stale, set under the device lock) when the driver
+ * invalidates its cache or pushes the file's readiness.
+ *
+ * FILE LOCK MUST BE HELD for all of these
+ */
+static void fusd_readahead_drop(fusd_file_t *fusd_file)
+{
+	free_fusd_msg(&fusd_file->ra_msg);
+	fusd_file->ra_len = 0;
+	fusd_file->ra_head = 0;
+}
+
+/* serve a read from read-ahead data.  returns the number of bytes
+ * served, 0 if there was nothing for this offset, or -EFAULT */
+static int fusd_readahead_serve(fusd_file_t *fusd_file, char *buf, size_t count,
+                                loff_t *offset, int to_kernel)
+{
+	int n;
+
+	if (fusd_file->ra_msg == NULL)
+		return 0;
+
+	if (fusd_file->ra_stale) {
+		fusd_readahead_drop(fusd_file);
+		return 0;
+	}
+
+	/* the client went elsewhere: this much read-ahead was wasted */
+	if (*offset != fusd_file->ra_pos) {
+		fusd_readahead_drop(fusd_file);
+		fusd_file->ra_window /= 2;
+		return 0;
+	}
+
+	n = min_t(size_t, count, fusd_file->ra_len);
+	if (fusd_copy_out(buf, fusd_file->ra_msg->data + fusd_file->ra_head, n, to_kernel))
+		return -EFAULT;
+
+	fusd_file->ra_head += n;
+	fusd_file->ra_len -= n;
+	if (fusd_file->ra_linear) {
+		fusd_file->ra_pos += n;
+		*offset = fusd_file->ra_pos;
+	}
+
+	/* all of it got used: read further ahead next time */
+	if (fusd_file->ra_len == 0) {
+		*offset = fusd_file->ra_end;
+		fusd_readahead_drop(fusd_file);
+		fusd_file->ra_window = min(fusd_file->ra_window * 2,
+		                           fusd_file->fusd_dev->ra_max);
+	}
+	return n;
+}
+
+/* how much to ask the driver for when the client wants count bytes */
+static size_t fusd_readahead_length(fusd_file_t *fusd_file, loff_t pos, size_t count)
+{
+	int ra_max = min(fusd_file->fusd_dev->ra_max, MAX_RW_SIZE);
+
+	if (pos != fusd_file->ra_next) {
+		fusd_file->ra_seq = 0;
+		return count;
+	}
+	if (++fusd_file->ra_seq < 2 || count >= ra_max)
+		return count;
+
+	if (fusd_file->ra_window < 2 * count)
+		fusd_file->ra_window = 4 * count;
+	if (fusd_file->ra_window > ra_max)
+		fusd_file->ra_window = ra_max;
+	return max_t(size_t, count, fusd_file->ra_window);
+}
+
+/* take the driver's reply to a read-ahead read sent for offset 'pos':
+ * give the client up to count bytes and keep the rest.  Takes over
+ * *reply if it keeps any. */
+static int fusd_readahead_reply(fusd_file_t *fusd_file, fusd_msg_t **reply,
+                                int retval, char *buf, size_t count,
+                                loff_t pos, loff_t *offset)
+{
+	int n = min_t(size_t, retval, count);
+	loff_t end = (*reply)->parm.fops_msg.offset;
+
+	if (n > 0 && copy_to_user(buf, (*reply)->data, n))
+		return -EFAULT;
+
+	if (retval == n) {
+		*offset = end;
+		return n;
+	}
+
+	/* the rest went stale while we waited: don't keep it */
+	if (fusd_file->ra_stale) {
+		*offset = (end == pos + retval) ? pos + n : end;
+		return n;
+	}
+
+	fusd_file->ra_msg = *reply;
+	*reply = NULL;
+	fusd_file->ra_head = n;
+	fusd_file->ra_len = retval - n;
+	fusd_file->ra_linear = (end == pos + retval);
+	fusd_file->ra_pos = fusd_file->ra_linear ? pos + n : pos;
+	fusd_file->ra_end = end;
+	*offset = fusd_file->ra_pos;
+	return n;
+}
+
+static ssize_t fusd_client_read(struct file *file, char *buf,
+                                size_t count, loff_t *offset)
+{
+	fusd_dev_t *fusd_dev;
+	fusd_file_t *fusd_file;
+	struct fusd_transaction *transaction;
+	fusd_msg_t fusd_msg, *reply = NULL;
+	int retval = -EPIPE;
+	int cached, readahead = 0;
+	size_t length = count;
+	loff_t fill_pos = 0;
+	unsigned long cache_gen = 0;
+	ssize_t done;
+
+	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
+
+	if (ZOMBIE(fusd_dev))
+		goto zombie_dev;
+
+	if (fusd_dev->flags & FUSD_DEV_STREAM)
+		return fusd_stream_read(fusd_file, file, buf, count, 0);
+
+	if (!FUSD_DEV_HAS(fusd_dev, FUSD_CAP_READ))
+		return -ENOSYS;
+
+	/* serve it from the page cache if we can -- unless the driver
+	 * said its files can't seek, in which case offsets mean nothing */
+	spin_lock(&fusd_file->meta_lock);
+	cached = (fusd_dev->flags & FUSD_DEV_PAGE_CACHE) && count > 0 &&
+	         !((fusd_file->meta_valid & FUSD_META_SEEKABLE) && !fusd_file->meta_seekable);
+	spin_unlock(&fusd_file->meta_lock);
+
+	if (cached && fusd_cache_read(fusd_dev, buf, count, *offset, &done)) {
+		if (done > 0)
+			*offset += done;
+		return done;
+	}
+
+	if ((retval = fusd_nonblock_cached(fusd_file, file, FUSD_NOTIFY_INPUT)) < 0)
+		return retval;
+
+	LOCK_FUSD_FILE(fusd_file);
+
+	RDEBUG(3, "got a read on /dev/%s (owned by pid %d) from pid %d",
+	       NAME(fusd_dev), fusd_dev->pid, current->pid);
+
+	/* reads see what was written before them */
+	if (fusd_file->wb_len > 0 || fusd_file->wb_transaction != NULL) {
+		if ((retval = fusd_wb_flush(fusd_file)) < 0)
+			goto done;
+	}
+
+	/* data we already read ahead for this file? */
+	if (!cached && (retval = fusd_readahead_serve(fusd_file, buf, count, offset, 0)) != 0)
+		goto done;
+
+	transaction = fusd_find_incomplete_transaction(fusd_file, FUSD_READ);
+	if (transaction && transaction->transid == fusd_file->ra_transid &&
+	    *offset == fusd_file->ra_sent_pos) {
+		/* an interrupted read-ahead: it's bigger than what we're asked
+		 * for, but that's fine */
+		readahead = 1;
+		length = transaction->size;
+		fill_pos = fusd_file->ra_sent_pos;
+	} else if (transaction && cached) {
+		/* we don't remember where an interrupted cache fill was going;
+		 * reads of cached devices are idempotent, so just start over */
+		fusd_cleanup_transaction(fusd_file, transaction);
+		transaction = NULL;
+	}
+	if (transaction && !readahead && transaction->size > count) {
+		RDEBUG(2,
+		       "Incomplete I/O transaction %ld thrown out, as the transaction's size of %d bytes was greater than "
+		       "the retry's size of %d bytes", transaction->transid, transaction->size, (int) count);
+
+		fusd_cleanup_transaction(fusd_file, transaction);
+		transaction = NULL;
+	}
+
+	if (transaction == NULL) {
+		/* make sure we aren't trying to read too big of a buffer */
+		if (count > MAX_RW_SIZE)
+			count = MAX_RW_SIZE;
+		length = count;
+		fill_pos = *offset;
+
+		/* to fill the page cache, read whole pages */
+		if (cached) {
+			fill_pos = *offset & PAGE_MASK;
+			length = PAGE_ALIGN(*offset + count) - fill_pos;
+			if (length > MAX_RW_SIZE) {
+				length = MAX_RW_SIZE;
+				count = fill_pos + length - *offset;
+			}
+			spin_lock(&fusd_cache_lock);
+			cache_gen = fusd_dev->cache_gen;
+			spin_unlock(&fusd_cache_lock);
+		} else if ((length = fusd_readahead_length(fusd_file, *offset, count)) > count) {
+			readahead = 1;
+		}
+
+		/* send the message */
+		init_fusd_msg(&fusd_msg);
+		fusd_msg.subcmd = FUSD_READ;
+		fusd_msg.parm.fops_msg.length = length;
+		fusd_msg.parm.fops_msg.offset = fill_pos;
+
+		/* send message to userspace */
+		if (readahead)
+			fusd_file->ra_stale = 0;
+		if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction)) < 0)
+			goto done;
+
+		if (readahead) {
+			fusd_file->ra_transid = transaction->transid;
+			fusd_file->ra_sent_pos = fill_pos;
+		}
+	}
+
+	/* and wait for the reply */
+	/* todo: store and retrieve the transid from the interrupted messsage */
+	retval = fusd_fops_call_wait(fusd_file, &reply, transaction);
+
+	/* the read-ahead is over, one way or another (except if we got
+	 * interrupted, in which case we'll be back for it) */
+	if (readahead && retval != -ERESTARTSYS)
+		fusd_file->ra_transid = 0;
+
+	/* return immediately in case of error */
+	if (retval < 0 || reply == NULL)
+		goto done;
+
+	/* adjust the reval if the retval indicates a larger read than the
+	 * data that was actually provided */
+	if (reply->datalen != retval) {
+		RDEBUG(1, "warning: /dev/%s driver (pid %d) claimed it returned %d bytes "
+		          "on read but actually returned %d",
+		       NAME(fusd_dev), fusd_dev->pid, retval, reply->datalen);
+		retval = reply->datalen;
+	}
+
+	/* adjust if the device driver gave us more data than the user asked for
+	 *     (bad!  bad!  why is the driver broken???) */
+	if (retval > length) {
+		RDEBUG(1, "warning: /dev/%s driver (pid %d) returned %d bytes on read but "
+		          "the user only asked for %d",
+		       NAME(fusd_dev), fusd_dev->pid, retval, (int) length);
+		retval = length;
+	}
+
+	if (cached) {
+		/* keep the pages, and give the user the part it asked for */
+		if (!ZOMBIE(fusd_dev))
+			fusd_cache_fill(fusd_dev, cache_gen, fill_pos, reply->data, retval,
+			                retval < length);
+
+		done = *offset - fill_pos;
+		retval = retval > done ? min_t(ssize_t, retval - done, count) : 0;
+		if (retval > 0 && copy_to_user(buf, reply->data + done, retval)) {
+			retval = -EFAULT;
+			goto done;
+		}
+		*offset += retval;
+		goto done;
+	}
+
+	if (readahead) {
+		retval = fusd_readahead_reply(fusd_file, &reply, retval, buf, count,
+		                              fill_pos, offset);
+		goto done;
+	}
+
+	/* copy the offset back from the message */
+	*offset = reply->parm.fops_msg.offset;
+
+	/* IFF return value indicates data present, copy it back */
+	if (retval > 0) {
+		if (copy_to_user(buf, reply->data, retval)) {
+			retval = -EFAULT;
+			goto done;
+		}
+	}
+
+done:
+	if (retval > 0) {
+		/* keep FIONREAD roughly right until the driver updates it */
+		spin_lock(&fusd_file->meta_lock);
+		if (fusd_file->meta_valid & FUSD_META_AVAIL)
+			fusd_file->meta_avail -= min_t(loff_t, fusd_file->meta_avail, retval);
+		spin_unlock(&fusd_file->meta_lock);
+	}
+
+	/* remember where a sequential reader would continue */
+	if (retval >= 0)
+		fusd_file->ra_next = *offset;
+
+	/* clear the readable bit of our cached poll state, unless the
+	 * driver pushes its readiness to us instead of answering polldiffs:
+	 * then only the driver knows whether there's more to read */
+	if (FUSD_DEV_HAS(fusd_dev, FUSD_CAP_POLL_DIFF))
+		fusd_poll_state_clear(fusd_file, FUSD_NOTIFY_INPUT);
+
+	free_fusd_msg(&reply);
+	UNLOCK_FUSD_FILE(fusd_file);
+	return retval;
+
+invalid_file:
+invalid_dev:
+zombie_dev:
+	RDEBUG(3, "got a read on client file from pid %d, driver has disappeared",
+	       current->pid);
+	return -EPIPE;
+}
+
+static int fusd_add_transaction(fusd_file_t *fusd_file, int transid, int subcmd, int size,
+                                struct fusd_transaction **out_transaction)
+{
+	struct fusd_transaction *transaction = (struct fusd_transaction *) KMALLOC(sizeof(struct fusd_transaction),
+	                                                                           GFP_KERNEL);
+	if (transaction == NULL)
+		return -ENOMEM;
+
+	transaction->msg_in = NULL;
+	transaction->transid = transid;
+	transaction->subcmd = subcmd;
+	transaction->pid = current->pid;
+	transaction->size = size;
+	init_waitqueue_head(&transaction->wait);
+	transaction->task = current;
+	get_task_struct(current);
+	/* what the driver may access is the memory the call was made
+	 * with, even if the caller execs meanwhile */
+	transaction->mm = get_task_mm(current);
+	transaction->waiting = 0;
+	transaction->async = 0;
+	transaction->offset = 0;
+	transaction->prot = 0;
+
+	down(&fusd_file->transactions_sem);
+	list_add_tail(&transaction->list, &fusd_file->transactions);
+	up(&fusd_file->transactions_sem);
+
+	if (out_transaction != NULL)
+		*out_transaction = transaction;
+
+	return 0;
+}
+
+static void fusd_cleanup_transaction(fusd_file_t *fusd_file, struct fusd_transaction *transaction)
+{
+	free_fusd_msg(&transaction->msg_in);
+	fusd_remove_transaction(fusd_file, transaction);
+}
+
+static void fusd_remove_transaction(fusd_file_t *fusd_file, struct fusd_transaction *transaction)
+{
+	down(&fusd_file->transactions_sem);
+	list_del(&transaction->list);
+	up(&fusd_file->transactions_sem);
+
+	fusd_free_transaction(transaction);
+}
+
+static struct fusd_transaction *fusd_find_transaction(fusd_file_t *fusd_file, int transid)
+{
+	struct list_head *i;
+	down(&fusd_file->transactions_sem);
+
+	list_for_each(i, &fusd_file->transactions)
+	{
+		struct fusd_transaction *transaction = list_entry(i,
+		struct fusd_transaction, list);
+		if (transaction->transid == transid) {
+			up(&fusd_file->transactions_sem);
+			return transaction;
+		}
+	}
+	up(&fusd_file->transactions_sem);
+	return NULL;
+}
+
+static struct fusd_transaction *fusd_find_transaction_by_pid(fusd_file_t *fusd_file, int pid)
+{
+	struct list_head *i;
+	down(&fusd_file->transactions_sem);
+
+	list_for_each(i, &fusd_file->transactions)
+	{
+		struct fusd_transaction *transaction = list_entry(i,
+		struct fusd_transaction, list);
+		/* faults keep theirs apart (see fusd_fault_call) */
+		if (transaction->pid == pid && !transaction->async &&
+		    transaction->subcmd != FUSD_FAULT) {
+			up(&fusd_file->transactions_sem);
+			return transaction;
+		}
+	}
+	up(&fusd_file->transactions_sem);
+	return NULL;
+}
+
+static ssize_t fusd_client_write(struct file *file,
+                                 const char *buffer,
+                                 size_t length,
+                                 loff_t *offset)
+{
+	fusd_dev_t *fusd_dev;
+	fusd_file_t *fusd_file;
+	fusd_msg_t fusd_msg;
+	fusd_msg_t *reply = NULL;
+	int retval = -EPIPE;
+	struct fusd_transaction *transaction;
+
+	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
+
+	if (ZOMBIE(fusd_dev))
+		goto zombie_dev;
+
+	if (!FUSD_DEV_HAS(fusd_dev, FUSD_CAP_WRITE))
+		return -ENOSYS;
+
+	if (FUSD_WRITE_BEHIND(fusd_dev)) {
+		LOCK_FUSD_FILE(fusd_file);
+		retval = fusd_wb_write(fusd_file, file, buffer, length, offset);
+		UNLOCK_FUSD_FILE(fusd_file);
+		if (retval != -ENOSPC)
+			return retval;
+		/* too big to buffer: write it the usual way */
+	} else if ((retval = fusd_nonblock_cached(fusd_file, file, FUSD_NOTIFY_OUTPUT)) < 0) {
+		return retval;
+	}
+
+	LOCK_FUSD_FILE(fusd_file);
+
+	RDEBUG(3, "got a write on /dev/%s (owned by pid %d) from pid %d",
+	       NAME(fusd_dev), fusd_dev->pid, current->pid);
+
+	/* what we read ahead may be what this overwrites */
+	fusd_readahead_drop(fusd_file);
+
+	/* writes buffered before the flag was turned off go first */
+	if (fusd_file->wb_len > 0 || fusd_file->wb_transaction != NULL) {
+		if ((retval = fusd_wb_flush(fusd_file)) < 0)
+			goto done;
+		if ((retval = fusd_wb_error(fusd_file)) < 0)
+			goto done;
+	}
+
+	transaction = fusd_find_incomplete_transaction(fusd_file, FUSD_WRITE);
+	if (transaction && transaction->size != length) {
+		RDEBUG(2,
+		       "Incomplete I/O transaction %ld thrown out, as the transaction's size of %d bytes was not equal to "
+		       "the retry's size of %d bytes", transaction->transid, transaction->size, (int) length);
+
+		fusd_cleanup_transaction(fusd_file, transaction);
+		transaction = NULL;
+	}
+	if (transaction == NULL) {
+		if (length < 0) {
+			RDEBUG(2, "fusd_client_write: got invalid length %d", (int) length);
+			retval = -EINVAL;
+			goto done;
+		}
+
+		if (length > MAX_RW_SIZE)
+			length = MAX_RW_SIZE;
+
+		init_fusd_msg(&fusd_msg);
+
+		/* sigh.. i guess zero length writes should be legal */
+		if (length > 0 && length <= FUSD_INLINE_MAX) {
+			if (copy_from_user(fusd_msg.inline_data, buffer, length)) {
+				retval = -EFAULT;
+				goto done;
+			}
+			fusd_msg.datalen = length;
+		} else if (length > 0) {
+			if ((fusd_msg.data = VMALLOC(length)) == NULL) {
+				retval = -ENOMEM;
+				goto done;
+			}
+
+			if (copy_from_user(fusd_msg.data, buffer, length)) {
+				retval = -EFAULT;
+				goto done;
+			}
+			fusd_msg.datalen = length;
+		}
+
+		fusd_msg.subcmd = FUSD_WRITE;
+		fusd_msg.parm.fops_msg.length = length;
+		fusd_msg.parm.fops_msg.offset = *offset;
+
+		if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction)) < 0)
+			goto done;
+	}
+	/* todo: fix transid on restart */
+	retval = fusd_fops_call_wait(fusd_file, &reply, transaction);
+
+	if (retval < 0 || reply == NULL)
+		goto done;
+
+	/* drivers should not write more bytes than they were asked to! */
+	if (retval > length) {
+		RDEBUG(1, "warning: /dev/%s driver (pid %d) returned %d bytes on write; "
+		          "the user only wanted %d",
+		       NAME(fusd_dev), fusd_dev->pid, retval, (int) length);
+		retval = length;
+	}
+
+	/* what was cached of the range written is now stale */
+	if (retval > 0 && (fusd_dev->flags & FUSD_DEV_PAGE_CACHE))
+		fusd_cache_invalidate(fusd_dev, *offset, retval);
+
+	*offset = reply->parm.fops_msg.offset;
+
+	/* all done! */
+
+done:
+	/* clear the writable bit of our cached poll state (see read) */
+	if (FUSD_DEV_HAS(fusd_dev, FUSD_CAP_POLL_DIFF))
+		fusd_poll_state_clear(fusd_file, FUSD_NOTIFY_OUTPUT);
+
+	free_fusd_msg(&reply);
+	UNLOCK_FUSD_FILE(fusd_file);
+	return retval;
+
+invalid_file:
+invalid_dev:
+zombie_dev:
+	RDEBUG(3, "got a write on client file from pid %d, driver has disappeared",
+	       current->pid);
+	return -EPIPE;
+}
+
+#ifdef CONFIG_FUSD_SPLICE
+/*
+ * splice.  Reads hand the pages the driver's reply came in to the
+ * pipe as they are, and keep the reply until the last of them is
+ * released.  Writes gather what's in the pipe into one message, the
+ * copy a write() makes too, and take out of the pipe only what the
+ * driver wrote.
+ */
+struct fusd_splice_data {
+	atomic_t refcount;
+	fusd_msg_t *msg;	/* reply holding the data, or NULL */
+	void *buf;		/* or a vmalloc'd buffer holding it */
+};
+
+static void fusd_splice_put(struct fusd_splice_data *splice_data)
+{
+	if (atomic_dec_and_test(&splice_data->refcount)) {
+		free_fusd_msg(&splice_data->msg);
+		vfree(splice_data->buf);
+		KFREE(splice_data);
+	}
+}
+
+static void fusd_splice_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+	fusd_splice_put((struct fusd_splice_data *) buf->private);
+}
+
+static bool fusd_splice_buf_get(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+	atomic_inc(&((struct fusd_splice_data *) buf->private)->refcount);
+	return true;
+}
+
+/* the pages belong to the reply (or buffer): they can't be stolen */
+static int fusd_splice_buf_steal(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+	return 1;
+}
+
+static const struct pipe_buf_operations fusd_splice_buf_ops = {
+	.confirm = generic_pipe_buf_confirm,
+	.release = fusd_splice_buf_release,
+	.steal = fusd_splice_buf_steal,
+	.get = fusd_splice_buf_get,
+};
+
+/* may the pages data lives in be handed to a pipe?  not slab ones
+ * (small kmallocs, inline data) */
+static inline int fusd_splice_pages_ok(const char *data)
+{
+	return is_vmalloc_addr(data) || !PageSlab(virt_to_head_page(data));
+}
+
+/* add the len bytes at data to the pipe, a page at a time, without
+ * copying them.  Takes over msg and buf, which hold the data. */
+static ssize_t fusd_splice_to_pipe(struct pipe_inode_info *pipe, fusd_msg_t *msg,
+                                   void *buf, char *data, size_t len)
+{
+	struct fusd_splice_data *splice_data;
+	ssize_t retval = 0, n;
+
+	splice_data = KMALLOC(sizeof(struct fusd_splice_data), GFP_KERNEL);
+	if (splice_data == NULL) {
+		free_fusd_msg(&msg);
+		vfree(buf);
+		return -ENOMEM;
+	}
+	atomic_set(&splice_data->refcount, 1);
+	splice_data->msg = msg;
+	splice_data->buf = buf;
+
+	while (retval < len) {
+		char *p = data + retval;
+		struct pipe_buffer pipe_buf = {
+			.page = is_vmalloc_addr(p) ? vmalloc_to_page(p) : virt_to_page(p),
+			.offset = offset_in_page(p),
+			.len = min_t(size_t, len - retval, PAGE_SIZE - offset_in_page(p)),
+			.ops = &fusd_splice_buf_ops,
+			.private = (unsigned long) splice_data,
+		};
+
+		/* add_to_pipe releases it if it fails */
+		atomic_inc(&splice_data->refcount);
+		if ((n = add_to_pipe(pipe, &pipe_buf)) < 0) {
+			if (retval == 0)
+				retval = n;
+			break;
+		}
+		retval += n;
+	}
+
+	fusd_splice_put(splice_data);
+	return retval;
+}
+
+static ssize_t fusd_client_splice_read(struct file *file, loff_t *ppos,
+                                       struct pipe_inode_info *pipe, size_t len,
+                                       unsigned int flags)
+{
+	fusd_dev_t *fusd_dev;
+	fusd_file_t *fusd_file;
+	struct fusd_transaction *transaction;
+	fusd_msg_t fusd_msg, *reply = NULL;
+	ssize_t retval;
+	char *buf;
+
+	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
+
+	if (ZOMBIE(fusd_dev))
+		goto zombie_dev;
+
+	/* no more than the pipe has room for */
+	len = min_t(size_t, len, MAX_RW_SIZE);
+	len = min_t(size_t, len, (size_t) (pipe->max_usage -
+	                                   pipe_occupancy(pipe->head, pipe->tail)) << PAGE_SHIFT);
+	if (len == 0)
+		return -EAGAIN;
+
+	/* the stream ring is reused, so its data gets copied once */
+	if (fusd_dev->flags & FUSD_DEV_STREAM) {
+		if ((buf = vmalloc(len)) == NULL)
+			return -ENOMEM;
+		if ((retval = fusd_stream_read(fusd_file, file, buf, len, 1)) <= 0) {
+			vfree(buf);
+			return retval;
+		}
+		return fusd_splice_to_pipe(pipe, NULL, buf, buf, retval);
+	}
+
+	if (!FUSD_DEV_HAS(fusd_dev, FUSD_CAP_READ))
+		return -ENOSYS;
+
+	if ((retval = fusd_nonblock_cached(fusd_file, file, FUSD_NOTIFY_INPUT)) < 0)
+		return retval;
+
+	LOCK_FUSD_FILE(fusd_file);
+
+	RDEBUG(3, "got a splice read on /dev/%s (owned by pid %d) from pid %d",
+	       NAME(fusd_dev), fusd_dev->pid, current->pid);
+
+	/* reads see what was written before them */
+	if (fusd_file->wb_len > 0 || fusd_file->wb_transaction != NULL) {
+		if ((retval = fusd_wb_flush(fusd_file)) < 0)
+			goto done;
+	}
+
+	/* data already read ahead goes first */
+	if (fusd_file->ra_msg != NULL) {
+		if ((buf = vmalloc(len)) == NULL) {
+			retval = -ENOMEM;
+			goto done;
+		}
+		if ((retval = fusd_readahead_serve(fusd_file, buf, len, ppos, 1)) > 0) {
+			retval = fusd_splice_to_pipe(pipe, NULL, buf, buf, retval);
+			goto done;
+		}
+		vfree(buf);
+		if (retval < 0)
+			goto done;
+	}
+
+	/* an interrupted read-ahead, or read of another size, can't be
+	 * picked up by a splice */
+	transaction = fusd_find_incomplete_transaction(fusd_file, FUSD_READ);
+	if (transaction && (transaction->transid == fusd_file->ra_transid ||
+	                    transaction->size != len)) {
+		RDEBUG(2, "Incomplete I/O transaction %ld thrown out by a splice",
+		       transaction->transid);
+		if (transaction->transid == fusd_file->ra_transid)
+			fusd_file->ra_transid = 0;
+		fusd_cleanup_transaction(fusd_file, transaction);
+		transaction = NULL;
+	}
+
+	if (transaction == NULL) {
+		init_fusd_msg(&fusd_msg);
+		fusd_msg.subcmd = FUSD_READ;
+		fusd_msg.parm.fops_msg.length = len;
+		fusd_msg.parm.fops_msg.offset = *ppos;
+
+		if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction)) < 0)
+			goto done;
+	}
+
+	retval = fusd_fops_call_wait(fusd_file, &reply, transaction);
+	if (retval < 0 || reply == NULL)
+		goto done;
+
+	/* trust the data, not what the driver says it returned */
+	retval = min_t(ssize_t, reply->datalen, len);
+	*ppos = reply->parm.fops_msg.offset;
+
+	if (retval > 0) {
+		if (fusd_splice_pages_ok(reply->data)) {
+			retval = fusd_splice_to_pipe(pipe, reply, NULL, reply->data, retval);
+			reply = NULL;
+		} else if ((buf = vmalloc(retval)) == NULL) {
+			retval = -ENOMEM;
+		} else {
+			memcpy(buf, reply->data, retval);
+			retval = fusd_splice_to_pipe(pipe, NULL, buf, buf, retval);
+		}
+	}
+
+done:
+	if (retval > 0) {
+		/* keep FIONREAD roughly right (see read) */
+		spin_lock(&fusd_file->meta_lock);
+		if (fusd_file->meta_valid & FUSD_META_AVAIL)
+			fusd_file->meta_avail -= min_t(loff_t, fusd_file->meta_avail, retval);
+		spin_unlock(&fusd_file->meta_lock);
+	}
+	if (retval >= 0)
+		fusd_file->ra_next = *ppos;
+	if (FUSD_DEV_HAS(fusd_dev, FUSD_CAP_POLL_DIFF))
+		fusd_poll_state_clear(fusd_file, FUSD_NOTIFY_INPUT);
+
+	free_fusd_msg(&reply);
+	UNLOCK_FUSD_FILE(fusd_file);
+	return retval;
+
+invalid_file:
+invalid_dev:
+zombie_dev:
+	RDEBUG(3, "got a splice read on client file from pid %d, driver has disappeared",
+	       current->pid);
+	return -EPIPE;
+}
+
+/* the pipe buffer n slots past the pipe's tail */
+static inline struct pipe_buffer *fusd_pipe_buf(struct pipe_inode_info *pipe, unsigned int n)
+{
+	return &pipe->bufs[(pipe->tail + n) & (pipe->ring_size - 1)];
+}
+
+static ssize_t fusd_client_splice_write(struct pipe_inode_info *pipe, struct file *file,
+                                        loff_t *ppos, size_t len, unsigned int flags)
+{
+	fusd_dev_t *fusd_dev;
+	fusd_file_t *fusd_file;
+	struct fusd_transaction *transaction;
+	fusd_msg_t fusd_msg, *reply = NULL;
+	struct pipe_buffer *buf;
+	unsigned int i, occupancy;
+	ssize_t retval;
+	size_t n, total = 0;
+	loff_t pos = *ppos;
+	char *data, *src;
+
+	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
+
+	if (ZOMBIE(fusd_dev))
+		goto zombie_dev;
+
+	if (!FUSD_DEV_HAS(fusd_dev, FUSD_CAP_WRITE))
+		return -ENOSYS;
+
+	len = min_t(size_t, len, MAX_RW_SIZE);
+
+	pipe_lock(pipe);
+
+	/* wait for something to write */
+	while (pipe_empty(pipe->head, pipe->tail)) {
+		retval = 0;
+		if (!pipe->writers)
+			goto out_pipe;
+		retval = -EAGAIN;
+		if (flags & SPLICE_F_NONBLOCK)
+			goto out_pipe;
+		retval = -ERESTARTSYS;
+		if (signal_pending(current))
+			goto out_pipe;
+		pipe_wait(pipe);
+	}
+
+	/* gather (up to len of) what's in it into one write */
+	occupancy = pipe_occupancy(pipe->head, pipe->tail);
+	for (i = 0; i < occupancy && total < len; i++)
+		total += fusd_pipe_buf(pipe, i)->len;
+	total = min(total, len);
+
+	retval = -ENOMEM;
+	if ((data = VMALLOC(total)) == NULL)
+		goto out_pipe;
+
+	retval = 0;
+	for (i = 0, n = 0; n < total; i++) {
+		buf = fusd_pipe_buf(pipe, i);
+		if ((retval = pipe_buf_confirm(pipe, buf)) < 0)
+			break;
+		src = kmap_atomic(buf->page);
+		memcpy(data + n, src + buf->offset, min_t(size_t, buf->len, total - n));
+		kunmap_atomic(src);
+		n += min_t(size_t, buf->len, total - n);
+	}
+	if (n == 0) {
+		VFREE(data);
+		goto out_pipe;
+	}
+
+	LOCK_FUSD_FILE(fusd_file);
+
+	RDEBUG(3, "got a splice write on /dev/%s (owned by pid %d) from pid %d",
+	       NAME(fusd_dev), fusd_dev->pid, current->pid);
+
+	fusd_readahead_drop(fusd_file);
+
+	/* writes buffered before go first */
+	if (fusd_file->wb_len > 0 || fusd_file->wb_transaction != NULL) {
+		if ((retval = fusd_wb_flush(fusd_file)) < 0 ||
+		    (retval = fusd_wb_error(fusd_file)) < 0) {
+			VFREE(data);
+			goto done;
+		}
+	}
+
+	init_fusd_msg(&fusd_msg);
+	if (n <= FUSD_INLINE_MAX) {
+		memcpy(fusd_msg.inline_data, data, n);
+		VFREE(data);
+	} else {
+		fusd_msg.data = data;
+	}
+	fusd_msg.datalen = n;
+	fusd_msg.subcmd = FUSD_WRITE;
+	fusd_msg.parm.fops_msg.length = n;
+	fusd_msg.parm.fops_msg.offset = pos;
+
+	if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction)) < 0) {
+		if (fusd_msg.data != NULL)
+			VFREE(fusd_msg.data);
+		goto done;
+	}
+
+	retval = fusd_fops_call_wait(fusd_file, &reply, transaction);
+	if (retval == -ERESTARTSYS) {
+		/* a splice can't come back for its reply the way a write
+		 * does, and the driver has the data: count it as written */
+		fusd_cleanup_transaction(fusd_file, transaction);
+		retval = n;
+		pos += n;
+	} else if (retval < 0 || reply == NULL) {
+		goto done;
+	} else {
+		if (retval > n) {
+			RDEBUG(1, "warning: /dev/%s driver (pid %d) returned %d bytes on write; "
+			          "the user only wanted %d",
+			       NAME(fusd_dev), fusd_dev->pid, (int) retval, (int) n);
+			retval = n;
+		}
+		pos = reply->parm.fops_msg.offset;
+	}
+
+	if (retval > 0 && (fusd_dev->flags & FUSD_DEV_PAGE_CACHE))
+		fusd_cache_invalidate(fusd_dev, *ppos, retval);
+	*ppos = pos;
+
+	/* take what was written out of the pipe */
+	for (n = retval; n > 0; ) {
+		buf = fusd_pipe_buf(pipe, 0);
+		if (n < buf->len) {
+			buf->offset += n;
+			buf->len -= n;
+			break;
+		}
+		n -= buf->len;
+		pipe_buf_release(pipe, buf);
+		pipe->tail++;
+	}
+
+done:
+	if (FUSD_DEV_HAS(fusd_dev, FUSD_CAP_POLL_DIFF))
+		fusd_poll_state_clear(fusd_file, FUSD_NOTIFY_OUTPUT);
+
+	free_fusd_msg(&reply);
+	UNLOCK_FUSD_FILE(fusd_file);
+
+out_pipe:
+	pipe_unlock(pipe);
+	if (retval > 0) {
+		wake_up_interruptible_sync_poll(&pipe->wr_wait, EPOLLOUT | EPOLLWRNORM);
+		kill_fasync(&pipe->fasync_writers, SIGIO, POLL_OUT);
+	}
+	return retval;
+
+invalid_file:
+invalid_dev:
+zombie_dev:
+	RDEBUG(3, "got a splice write on client file from pid %d, driver has disappeared",
+	       current->pid);
+	return -EPIPE;
+}
+#endif /* CONFIG_FUSD_SPLICE */
+
+/*
+ * DEVICE LOCK MUST BE HELD
+ *
+ * __fusd_dev_accepts_ioctl: returns 1 if cmd falls in one of the ioctl
+ * ranges declared by the driver (or if it declared none), 0 if the
+ * driver has told us it doesn't want to hear about it.
+ */
+static int __fusd_dev_accepts_ioctl(fusd_dev_t *fusd_dev, unsigned int cmd)
+{
+	fusd_ioctl_range_t *ranges = fusd_dev->ioctl_ranges;
+	int i;
+
+	if (ranges == NULL)
+		return 1;
+
+	for (i = 0; i < fusd_dev->num_ioctl_ranges; i++)
+		if (cmd >= ranges[i].first && cmd <= ranges[i].last)
+			return 1;
+	return 0;
+}
+
+static int fusd_dev_accepts_ioctl(fusd_dev_t *fusd_dev, unsigned int cmd)
+{
+	int retval;
+
+	LOCK_FUSD_DEV(fusd_dev);
+	retval = __fusd_dev_accepts_ioctl(fusd_dev, cmd);
+	UNLOCK_FUSD_DEV(fusd_dev);
+	return retval;
+
+zombie_dev:
+	/* let the caller discover the zombie on its own */
+	return 1;
+}
+
+/*
+ * DEVICE LOCK MUST BE HELD
+ *
+ * __fusd_ioctl_cache_get: copies the cached answer to an _IOR ioctl
+ * into buf (_IOC_SIZE(cmd) bytes) and returns its retval, or returns
+ * -ENOENT if there is none.  *gen is set for fusd_ioctl_cache_fill.
+ * A NULL buf only checks for an answer.
+ */
+static int __fusd_ioctl_cache_get(fusd_dev_t *fusd_dev, unsigned int cmd,
+                                  void *buf, unsigned long *gen)
+{
+	struct fusd_ioctl_answer *answer;
+
+	*gen = fusd_dev->ioctl_cache_gen;
+	list_for_each_entry(answer, &fusd_dev->ioctl_cache, list) {
+		if (answer->cmd != cmd)
+			continue;
+		if (answer->valid && answer->ttl && time_after(jiffies, answer->expires))
+			answer->valid = 0;
+		if (!answer->valid)
+			break;
+		if (buf != NULL)
+			memcpy(buf, answer->data, _IOC_SIZE(cmd));
+		return answer->retval;
+	}
+	return -ENOENT;
+}
+
+/*
+ * fusd_ioctl_cache_get: answers an _IOR ioctl the driver marked
+ * cacheable, if we hold an answer that hasn't expired.  Otherwise
+ * returns -ENOENT, with *gen set for fusd_ioctl_cache_fill.  The
+ * answer is copied out of the cache under the device lock, and to
+ * the client once it's dropped: a fault mustn't stall the driver.
+ * Only a hit allocates the buffer for that; if it can't be had, the
+ * driver is asked instead.
+ */
+static int fusd_ioctl_cache_get(fusd_dev_t *fusd_dev, unsigned int cmd,
+                                unsigned long arg, unsigned long *gen)
+{
+	char *buf = NULL;
+	int retval;
+
+	if (_IOC_DIR(cmd) != _IOC_READ || list_empty(&fusd_dev->ioctl_cache))
+		return -ENOENT;
+
+	LOCK_FUSD_DEV(fusd_dev);
+	retval = __fusd_ioctl_cache_get(fusd_dev, cmd, NULL, gen);
+	UNLOCK_FUSD_DEV(fusd_dev);
+	if (retval == -ENOENT)
+		return -ENOENT;
+
+	if ((buf = KMALLOC(_IOC_SIZE(cmd), GFP_KERNEL)) == NULL) {
+		RDEBUG(1, "yikes!  kernel can't allocate memory");
+		return -ENOENT;
+	}
+
+	/* it may have expired or been dropped meanwhile */
+	LOCK_FUSD_DEV(fusd_dev);
+	retval = __fusd_ioctl_cache_get(fusd_dev, cmd, buf, gen);
+	UNLOCK_FUSD_DEV(fusd_dev);
+
+	if (retval != -ENOENT && copy_to_user((void *) arg, buf, _IOC_SIZE(cmd)))
+		retval = -EFAULT;
+	KFREE(buf);
+	return retval;
+
+zombie_dev:
+	if (buf != NULL)
+		KFREE(buf);
+	return -ENOENT;
+}
+
+/*
+ * fusd_ioctl_cache_fill: keeps the driver's reply to a cacheable
+ * ioctl, unless the driver changed its answers since we asked
+ * (fusd_ioctl_cache_get gave us gen) -- the reply may be stale.
+ */
+static void fusd_ioctl_cache_fill(fusd_dev_t *fusd_dev, unsigned int cmd,
+                                  unsigned long gen, fusd_msg_t *reply,
+                                  int retval)
+{
+	struct fusd_ioctl_answer *answer;
+
+	if (list_empty(&fusd_dev->ioctl_cache))
+		return;
+
+	LOCK_FUSD_DEV(fusd_dev);
+	if (gen != fusd_dev->ioctl_cache_gen)
+		goto out;
+	list_for_each_entry(answer, &fusd_dev->ioctl_cache, list) {
+		if (answer->cmd != cmd)
+			continue;
+		if (!answer->valid) {
+			memcpy(answer->data, reply->data, _IOC_SIZE(cmd));
+			answer->retval = retval;
+			answer->expires = jiffies + answer->ttl;
+			answer->valid = 1;
+		}
+		break;
+	}
+out:
+	UNLOCK_FUSD_DEV(fusd_dev);
+zombie_dev:
+	return;
+}
+
+/* bytes of data following a batch op in a FUSD_BATCH message, or -1
+ * if the op is no good */
+static int fusd_batch_data_size(fusd_batch_op_t *op)
+{
+	switch (op->op) {
+		case FUSD_BATCH_READ:
+			return op->length <= MAX_RW_SIZE ? op->length : -1;
+		case FUSD_BATCH_IOCTL:
+			if (!(_IOC_DIR(op->cmd) & (_IOC_READ | _IOC_WRITE)))
+				return 0;
+			if (_IOC_SIZE(op->cmd) <= 0 || _IOC_SIZE(op->cmd) > MAX_RW_SIZE)
+				return -1;
+			return _IOC_SIZE(op->cmd);
+		default:
+			return -1;
+	}
+}
+
+/*
+ * fusd_batch_build: makes the FUSD_BATCH message for the ops of a
+ * batch.  Ops that can't succeed, and ioctls we can answer from the
+ * cache, are done here and marked FUSD_BATCH_DONE, with no data.
+ * Returns the number of ops left for the driver, or -errno.
+ */
+static int fusd_batch_build(fusd_dev_t *fusd_dev, fusd_batch_op_t *ops,
+                            int count, fusd_msg_t *fusd_msg)
+{
+	fusd_batch_op_t *sent;
+	unsigned long cache_gen;
+	char *data;
+	int i, size, total, done, retval, pending = 0;
+
+	total = count * sizeof(fusd_batch_op_t);
+	for (i = 0; i < count; i++) {
+		if ((size = fusd_batch_data_size(&ops[i])) > 0)
+			total += size;
+	}
+	if (total > MAX_RW_SIZE)
+		return -E2BIG;
+
+	if ((fusd_msg->data = VMALLOC(total)) == NULL)
+		return -ENOMEM;
+	fusd_msg->datalen = total;
+	/* the read slots go to the driver as they are */
+	memset(fusd_msg->data, 0, total);
+
+	sent = (fusd_batch_op_t *) fusd_msg->data;
+	data = fusd_msg->data + count * sizeof(fusd_batch_op_t);
+	memcpy(sent, ops, count * sizeof(fusd_batch_op_t));
+
+	for (i = 0; i < count; i++) {
+		size = fusd_batch_data_size(&ops[i]);
+		sent[i].result = 0;
+		done = 0;
+		if (size < 0)
+			sent[i].result = -EINVAL;
+		else if (ops[i].op == FUSD_BATCH_READ) {
+			if (fusd_dev->flags & FUSD_DEV_STREAM)
+				sent[i].result = -EINVAL;
+			else if (!FUSD_DEV_HAS(fusd_dev, FUSD_CAP_READ))
+				sent[i].result = -ENOSYS;
+		} else if (!FUSD_DEV_HAS(fusd_dev, FUSD_CAP_IOCTL))
+			sent[i].result = -ENOSYS;
+		else if (!fusd_dev_accepts_ioctl(fusd_dev, ops[i].cmd))
+			sent[i].result = -ENOTTY;
+		else if ((retval = fusd_ioctl_cache_get(fusd_dev, ops[i].cmd,
+		                                        (unsigned long) ops[i].arg,
+		                                        &cache_gen)) != -ENOENT) {
+			sent[i].result = retval;
+			done = 1;
+		} else if (size > 0 && (_IOC_DIR(ops[i].cmd) & _IOC_WRITE) &&
+		           copy_from_user(data, ops[i].arg, size))
+			sent[i].result = -EFAULT;
+
+		if (done || sent[i].result < 0) {
+			sent[i].op = FUSD_BATCH_DONE;
+			sent[i].length = 0;
+			if (size > 0)
+				fusd_msg->datalen -= size;
+			continue;
+		}
+
+		sent[i].length = size;
+		data += size;
+		pending++;
+	}
+	return pending;
+}
+
+/*
+ * fusd_client_batch: the FUSD_IOC_BATCH ioctl.  The reads and ioctls
+ * it holds go to the driver in one FUSD_BATCH message, which it sends
+ * back with the results in place; those, and the data read, go back
+ * to the caller.  Returns 0 if the batch was run (each op has its own
+ * result), or -errno if it wasn't.
+ */
+static int fusd_client_batch(fusd_file_t *fusd_file, fusd_dev_t *fusd_dev,
+                             fusd_batch_t *user_batch)
+{
+	fusd_batch_t batch;
+	fusd_batch_op_t *ops, *replied;
+	fusd_msg_t fusd_msg, *reply = NULL;
+	struct fusd_transaction *transaction;
+	char *data, *end;
+	int i, n, retval;
+
+	if (copy_from_user(&batch, user_batch, sizeof(batch)))
+		return -EFAULT;
+	if (batch.count == 0 || batch.count > FUSD_BATCH_MAX_OPS)
+		return -EINVAL;
+	if ((ops = KMALLOC(batch.count * sizeof(fusd_batch_op_t), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	if (copy_from_user(ops, batch.ops, batch.count * sizeof(fusd_batch_op_t))) {
+		KFREE(ops);
+		return -EFAULT;
+	}
+
+	init_fusd_msg(&fusd_msg);
+	fusd_msg.subcmd = FUSD_BATCH;
+	fusd_msg.parm.fops_msg.length = batch.count;
+	if ((retval = fusd_batch_build(fusd_dev, ops, batch.count, &fusd_msg)) <= 0) {
+		replied = (fusd_batch_op_t *) fusd_msg.data;
+		for (i = 0; replied != NULL && i < batch.count; i++)
+			ops[i].result = replied[i].result;
+		goto copy_results;
+	}
+
+	LOCK_FUSD_FILE(fusd_file);
+
+	RDEBUG(3, "got a batch of %d ops on /dev/%s (owned by pid %d) from pid %d",
+	       batch.count, NAME(fusd_dev), fusd_dev->pid, current->pid);
+
+	/* its ioctls may change what reads return */
+	fusd_readahead_drop(fusd_file);
+
+	/* the driver sees it after the writes made before it */
+	if (fusd_file->wb_len > 0 || fusd_file->wb_transaction != NULL) {
+		if ((retval = fusd_wb_flush(fusd_file)) == 0)
+			retval = fusd_wb_error(fusd_file);
+		if (retval < 0)
+			goto done;
+	}
+
+	/* a restarted call: the driver already has the batch */
+	transaction = fusd_find_incomplete_transaction(fusd_file, FUSD_BATCH);
+	if (transaction == NULL) {
+		if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction)) < 0)
+			goto done;
+		fusd_msg.data = NULL; /* the queued message has it now */
+	}
+
+	if ((retval = fusd_fops_call_wait(fusd_file, &reply, transaction)) < 0 || reply == NULL)
+		goto done;
+
+	/* check the driver sent back what it was sent, and hand out the
+	 * results and data */
+	n = batch.count * sizeof(fusd_batch_op_t);
+	if (reply->data == NULL || reply->datalen < n) {
+		RDEBUG(2, "client batch got a screwy reply (%d bytes)", reply->datalen);
+		retval = -EIO;
+		goto done;
+	}
+	replied = (fusd_batch_op_t *) reply->data;
+	data = reply->data + n;
+	end = reply->data + reply->datalen;
+	for (i = 0; i < batch.count; i++) {
+		if (replied[i].length > end - data ||
+		    (replied[i].op != FUSD_BATCH_DONE &&
+		     (replied[i].op != ops[i].op || replied[i].cmd != ops[i].cmd ||
+		      replied[i].length != fusd_batch_data_size(&ops[i])))) {
+			RDEBUG(2, "client batch got a screwy reply for op %d", i);
+			retval = -EIO;
+			goto done;
+		}
+
+		ops[i].result = replied[i].result;
+		if (replied[i].op != FUSD_BATCH_DONE && replied[i].result >= 0) {
+			n = 0;
+			if (ops[i].op == FUSD_BATCH_READ)
+				n = ops[i].result = min_t(int, replied[i].result, ops[i].length);
+			else if (_IOC_DIR(ops[i].cmd) & _IOC_READ)
+				n = replied[i].length;
+			if (n > 0 && copy_to_user(ops[i].arg, data, n))
+				ops[i].result = -EFAULT;
+		}
+		data += replied[i].length;
+	}
+	retval = 0;
+
+done:
+	free_fusd_msg(&reply);
+	UNLOCK_FUSD_FILE(fusd_file);
+copy_results:
+	if (fusd_msg.data != NULL)
+		VFREE(fusd_msg.data);
+	if (retval >= 0 &&
+	    copy_to_user(batch.ops, ops, batch.count * sizeof(fusd_batch_op_t)))
+		retval = -EFAULT;
+	KFREE(ops);
+	return retval;
+}
+
+#ifndef HAVE_UNLOCKED_IOCTL
+static int fusd_client_ioctl(struct inode *inode, struct file *file,
+                             unsigned int cmd, unsigned long arg)
+#else
+static long fusd_client_unlocked_ioctl (struct file *file,
+			      unsigned int cmd, unsigned long arg)
+#endif
+{
+	fusd_dev_t *fusd_dev;
+	fusd_file_t *fusd_file;
+	fusd_msg_t fusd_msg, *reply = NULL;
+	int retval = -EPIPE, dir, length, restarted;
+	unsigned long cache_gen = 0;
+	struct fusd_transaction *transaction;
+
+	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
+
+	if (ZOMBIE(fusd_dev))
+		goto zombie_dev;
+
+	/* answer FIONREAD ourselves if the driver published the count */
+	if (cmd == FIONREAD) {
+		loff_t avail = -1;
+
+		spin_lock(&fusd_file->meta_lock);
+		if (fusd_file->meta_valid & FUSD_META_AVAIL)
+			avail = fusd_file->meta_avail;
+		spin_unlock(&fusd_file->meta_lock);
+
+		if (avail >= 0)
+			return put_user((int) min_t(loff_t, avail, INT_MAX), (int *) arg);
+	}
+
+	/* batches are ours to take apart */
+	if (cmd == FUSD_IOC_BATCH)
+		return fusd_client_batch(fusd_file, fusd_dev, (fusd_batch_t *) arg);
+
+	/* answer it ourselves if the driver told us what to say */
+	if ((retval = fusd_ioctl_cache_get(fusd_dev, cmd, arg, &cache_gen)) != -ENOENT)
+		return retval;
+
+	/* reject what the driver told us it doesn't handle */
+	if (!FUSD_DEV_HAS(fusd_dev, FUSD_CAP_IOCTL))
+		return -ENOSYS;
+	if (!fusd_dev_accepts_ioctl(fusd_dev, cmd))
+		return -ENOTTY;
+
+	LOCK_FUSD_FILE(fusd_file);
+
+	RDEBUG(3, "got an ioctl on /dev/%s (owned by pid %d) from pid %d",
+	       NAME(fusd_dev), fusd_dev->pid, current->pid);
+
+	/* it may change what reads return */
+	fusd_readahead_drop(fusd_file);
+
+	/* the driver sees it after the writes made before it */
+	if (fusd_file->wb_len > 0 || fusd_file->wb_transaction != NULL) {
+		if ((retval = fusd_wb_flush(fusd_file)) == 0)
+			retval = fusd_wb_error(fusd_file);
+		if (retval < 0)
+			goto done;
+	}
+
+	dir = _IOC_DIR(cmd);
+	length = _IOC_SIZE(cmd);
+
+	transaction = fusd_find_incomplete_transaction(fusd_file, FUSD_IOCTL);
+	// todo: Check to make sure the transaction is for the same IOCTL
+	restarted = (transaction != NULL);
+
+	if (transaction == NULL) {
+		/* if we're trying to read or write, make sure length is sane */
+		if ((dir & (_IOC_WRITE | _IOC_READ)) &&
+		    (length <= 0 || length > MAX_RW_SIZE)) {
+			RDEBUG(2, "client ioctl got crazy IOC_SIZE of %d", length);
+			retval = -EINVAL;
+			goto done;
+		}
+
+		/* fill the struct */
+		init_fusd_msg(&fusd_msg);
+		fusd_msg.subcmd = FUSD_IOCTL;
+		fusd_msg.parm.fops_msg.cmd = cmd;
+		fusd_msg.parm.fops_msg.arg.arg = arg;
+
+		/* get the data if user is trying to write to the driver */
+		if ((dir & _IOC_WRITE) && length <= FUSD_INLINE_MAX) {
+			if (copy_from_user(fusd_msg.inline_data, (void *) arg, length)) {
+				retval = -EFAULT;
+				goto done;
+			}
+			fusd_msg.datalen = length;
+		} else if (dir & _IOC_WRITE) {
+			if ((fusd_msg.data = VMALLOC(length)) == NULL) {
+				RDEBUG(2, "can't vmalloc for client ioctl!");
+				retval = -ENOMEM;
+				goto done;
+			}
+
+			if (copy_from_user(fusd_msg.data, (void *) arg, length)) {
+				retval = -EFAULT;
+				goto done;
+			}
+			fusd_msg.datalen = length;
+		}
+
+		/* send request to the driver */
+		if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction)) < 0)
+			goto done;
+	}
+	/* get the response */
+	/* todo: fix transid on restart */
+	if ((retval = fusd_fops_call_wait(fusd_file, &reply, transaction)) < 0 || reply == NULL)
+		goto done;
+
+	/* if user is trying to read from the driver, copy data back */
+	if (dir & _IOC_READ) {
+		if (reply->data == NULL || reply->datalen != length) {
+			RDEBUG(2, "client_ioctl read reply with screwy data (%d, %d)",
+			       reply->datalen, length);
+			retval = -EIO;
+			goto done;
+		}
+		if (copy_to_user((void *) arg, reply->data, length)) {
+			retval = -EFAULT;
+			goto done;
+		}
+
+		/* remember the answer if it's one we may give ourselves
+		 * (not for a restarted call: we don't know when it was asked) */
+		if (dir == _IOC_READ && retval >= 0 && !restarted)
+			fusd_ioctl_cache_fill(fusd_dev, cmd, cache_gen, reply, retval);
+	}
+
+	/* all done! */
+done:
+	free_fusd_msg(&reply);
+	UNLOCK_FUSD_FILE(fusd_file);
+	return retval;
+
+invalid_file:
+invalid_dev :
+zombie_dev:
+	RDEBUG(3, "got an ioctl on client file from pid %d, driver has disappeared",
+	       current->pid);
+	return -EPIPE;
+}
+
+static void fusd_client_mm_open(struct vm_area_struct *vma);
+
+static void fusd_client_mm_close(struct vm_area_struct *vma);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+static vm_fault_t fusd_client_fault (struct vm_fault *vmf);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+static int fusd_client_fault (struct vm_fault *vmf);
+#elif LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 30)
+static int fusd_client_fault (struct vm_area_struct *vma, struct vm_fault *vmf);
+#else
+static int fusd_client_fault(struct vm_area_struct *vma, struct vm_fault *vmf, int *type);
+#endif
+
+static unsigned long fusd_mmap_pages(struct vm_area_struct *vma, unsigned long addr);
+
+static int fusd_mmap_insert(struct vm_area_struct *vma, unsigned long start,
+                            unsigned long npages, unsigned long *around_start,
+                            unsigned long *around_pages);
+
+static struct vm_operations_struct fusd_remap_vm_ops = {
+	.open = fusd_client_mm_open,
+	.close = fusd_client_mm_close,
+	.fault = fusd_client_fault,
+};
+
+/* a client mmap of a driver's buffer, shared by all the vmas it's
+ * split or forked into.  It holds a reference to the client's file,
+ * which therefore outlives it */
+struct fusd_mmap_instance {
+    fusd_dev_t *fusd_dev;
+    fusd_file_t *fusd_file;
+    struct file *file;		/* held until the driver's been told */
+    unsigned long addr;
+    unsigned long size;
+    unsigned long offset;	/* the mapping, as the driver was asked */
+    unsigned long length;
+    atomic_t refcount;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+    struct work_struct unmap_work;
+#else
+    struct delayed_work unmap_work;
+#endif
+};
+
+static void fusd_client_mm_open(struct vm_area_struct *vma)
+{
+	struct fusd_mmap_instance *mmap_instance = (struct fusd_mmap_instance *) vma->vm_private_data;
+	atomic_inc(&mmap_instance->refcount);
+
+}
+
+/* the last of a mapping's vmas is gone: tell the driver it can have
+ * its buffer back, and forget the mapping.  This runs from a work
+ * queue, as mm_close is called with the client's mm locked, and the
+ * file lock may be held by someone faulting on that very mm. */
+static void fusd_client_unmap_work(struct work_struct *work)
+{
+	struct fusd_mmap_instance *mmap_instance =
+		container_of(FUSD_DELAYED_WORK(work), struct fusd_mmap_instance, unmap_work);
+	fusd_file_t *fusd_file = mmap_instance->fusd_file;
+	fusd_dev_t *fusd_dev = mmap_instance->fusd_dev;
+	fusd_msg_t fusd_msg;
+
+	LOCK_FUSD_FILE(fusd_file);
+	if (!ZOMBIE(fusd_dev) && FUSD_DEV_HAS(fusd_dev, FUSD_CAP_MUNMAP)) {
+		init_fusd_msg(&fusd_msg);
+		fusd_msg.cmd = FUSD_FOPS_CALL_DROPREPLY;
+		fusd_msg.subcmd = FUSD_MUNMAP;
+		fusd_msg.parm.fops_msg.mmoffset = mmap_instance->offset;
+		fusd_msg.parm.fops_msg.length = mmap_instance->length;
+		fusd_msg.parm.fops_msg.arg.arg = mmap_instance->addr;
+
+		if (fusd_fops_call_send(fusd_file, &fusd_msg, NULL) < 0)
+			RDEBUG(2, "couldn't tell /dev/%s about an munmap", NAME(fusd_dev));
+	}
+	UNLOCK_FUSD_FILE(fusd_file);
+
+	fput(mmap_instance->file);
+	KFREE(mmap_instance);
+}
+
+static void fusd_client_mm_close(struct vm_area_struct *vma)
+{
+	struct fusd_mmap_instance *mmap_instance = (struct fusd_mmap_instance *) vma->vm_private_data;
+	if (atomic_dec_and_test(&mmap_instance->refcount)) {
+		schedule_delayed_work(&mmap_instance->unmap_work, 0);
+	}
+}
+
+/* pages of the vma from client address addr on that fall in the
+ * driver's buffer */
+static unsigned long fusd_mmap_pages(struct vm_area_struct *vma, unsigned long addr)
+{
+	struct fusd_mmap_instance *mmap_instance = (struct fusd_mmap_instance *) vma->vm_private_data;
+	unsigned long offset = (addr - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+	unsigned long end = vma->vm_end;
+
+	if (offset >= mmap_instance->size)
+		return 0;
+	if (mmap_instance->size - offset < end - addr)
+		end = addr + PAGE_ALIGN(mmap_instance->size - offset);
+	return (end - addr) >> PAGE_SHIFT;
+}
+
+/*
+ * fusd_mmap_insert: maps npages pages of the driver's buffer into the
+ * client's vma, from client address start on.  They are looked up in
+ * the driver's mm FUSD_MMAP_CHUNK at a time, rather than one per
+ * fault.  Pages that are already mapped are left alone.
+ *
+ * If around_start is not NULL, it and around_pages get the block to
+ * map around the first page: the huge page it belongs to in the
+ * driver, or else the FUSD_MMAP_FAULT_AROUND pages holding it.
+ *
+ * Returns 0, or -errno for the first page that couldn't be mapped
+ * (after which nothing more is).
+ */
+static int fusd_mmap_insert(struct vm_area_struct *vma, unsigned long start,
+                            unsigned long npages, unsigned long *around_start,
+                            unsigned long *around_pages)
+{
+	struct fusd_mmap_instance *mmap_instance = (struct fusd_mmap_instance *) vma->vm_private_data;
+	struct task_struct *task = mmap_instance->fusd_dev->task;
+	struct page *pages[FUSD_MMAP_CHUNK], *head;
+	unsigned long addr = start, daddr;
+	int i, n, got, retval = 0;
+
+	while (npages > 0 && retval == 0) {
+		n = min_t(unsigned long, npages, FUSD_MMAP_CHUNK);
+		daddr = mmap_instance->addr + (addr - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+
+		down_read(&task->mm->mmap_sem);
+		got = GET_USER_PAGES(task, task->mm, daddr, n, 1, 0, pages, NULL);
+		up_read(&task->mm->mmap_sem);
+		if (got <= 0)
+			return got < 0 ? got : -EFAULT;
+
+		if (around_start != NULL && addr == start) {
+			head = compound_head(pages[0]);
+			if (PageCompound(pages[0])) {
+				*around_pages = 1UL << compound_order(head);
+				*around_start = start - ((page_to_pfn(pages[0]) - page_to_pfn(head)) << PAGE_SHIFT);
+			} else {
+				*around_pages = FUSD_MMAP_FAULT_AROUND;
+				*around_start = start - ((((start - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff) %
+				                         FUSD_MMAP_FAULT_AROUND << PAGE_SHIFT);
+			}
+		}
+
+		for (i = 0; i < got; i++) {
+			if (retval == 0 && PageAnon(pages[i])) {
+				RDEBUG(2, "Cannot mmap non anonymous pages: The server is sharing a private page.\n"
+				          "Be sure to allocate your shared buffer with mmap and  MAP_SHARED | MAP_ANONYMOUS as flags.");
+				retval = -EINVAL;
+			} else if (retval == 0) {
+				retval = vm_insert_page(vma, addr, pages[i]);
+				if (retval == -EBUSY)	/* mapped already */
+					retval = 0;
+				addr += PAGE_SIZE;
+			}
+			put_page(pages[i]);
+		}
+		npages -= got;
+	}
+	return retval;
+}
+
+/*
+ * fusd_mmap_file: the driver answered an mmap with a shmem file (a
+ * memfd, usually), so the client's vma is handed over to that file,
+ * the way dma-buf does it.  Faults are then plain shmem faults,
+ * served from the page cache without walking the driver's mm, and
+ * the pages are never anonymous ones vm_insert_page would refuse.
+ */
+static int fusd_mmap_file(struct vm_area_struct *vma, struct file *backing,
+                          unsigned long offset)
+{
+	if (offset & ~PAGE_MASK)
+		return -EINVAL;
+
+	/* no writing through the client what the driver can't write */
+	if ((vma->vm_flags & VM_SHARED) && !(backing->f_mode & FMODE_WRITE)) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EACCES;
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	vma->vm_pgoff = offset >> PAGE_SHIFT;
+	get_file(backing);
+	fput(vma->vm_file);
+	vma->vm_file = backing;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	return call_mmap(backing, vma);
+#else
+	return backing->f_op->mmap(backing, vma);
+#endif
+}
+
+#ifdef CONFIG_FUSD_MMAP_FAULT
+/*
+ * Fault forwarding (FUSD_DEV_MMAP_FAULT): the memfd a driver maps
+ * clients onto may be sparse.  A client touching a page that isn't
+ * in it yet sends a FUSD_FAULT to the driver, which writes the page
+ * (and the missing ones after it) into the memfd and replies; shmem
+ * then maps it as usual.  With FUSD_DEV_MMAP_MKWRITE, the first write
+ * to a page of a shared mapping is reported too.
+ */
+struct fusd_fault_instance {
+	struct file *file;	/* the client's fusd file, kept open */
+	const struct vm_operations_struct *backing_ops;
+	atomic_t refcount;
+};
+
+static void fusd_fault_open(struct vm_area_struct *vma);
+static void fusd_fault_close(struct vm_area_struct *vma);
+static vm_fault_t fusd_fault_fault(struct vm_fault *vmf);
+static vm_fault_t fusd_fault_mkwrite(struct vm_fault *vmf);
+
+static const struct vm_operations_struct fusd_fault_vm_ops = {
+	.open = fusd_fault_open,
+	.close = fusd_fault_close,
+	.fault = fusd_fault_fault,
+	.map_pages = filemap_map_pages,
+};
+
+static const struct vm_operations_struct fusd_fault_mkwrite_vm_ops = {
+	.open = fusd_fault_open,
+	.close = fusd_fault_close,
+	.fault = fusd_fault_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = fusd_fault_mkwrite,
+};
+
+static void fusd_fault_open(struct vm_area_struct *vma)
+{
+	struct fusd_fault_instance *fault_instance = vma->vm_private_data;
+
+	atomic_inc(&fault_instance->refcount);
+}
+
+static void fusd_fault_close(struct vm_area_struct *vma)
+{
+	struct fusd_fault_instance *fault_instance = vma->vm_private_data;
+
+	if (atomic_dec_and_test(&fault_instance->refcount)) {
+		fput(fault_instance->file);
+		KFREE(fault_instance);
+	}
+}
+
+/* is page index of the memfd there (in memory or swapped out)? */
+static inline int fusd_fault_present(struct address_space *mapping, pgoff_t index)
+{
+	return xa_load(&mapping->i_pages, index) != NULL;
+}
+
+/* the fault of ours interrupted by a signal, if any.
+ * DEVICE LOCK MUST BE HELD */
+static struct fusd_transaction *fusd_find_fault_transaction(fusd_file_t *fusd_file)
+{
+	struct fusd_transaction *transaction;
+
+	down(&fusd_file->transactions_sem);
+	list_for_each_entry(transaction, &fusd_file->transactions, list) {
+		if (transaction->pid == current->pid && transaction->subcmd == FUSD_FAULT) {
+			up(&fusd_file->transactions_sem);
+			return transaction;
+		}
+	}
+	up(&fusd_file->transactions_sem);
+	return NULL;
+}
+
+/*
+ * ask the driver to fill (or get ready for a write to) a range of
+ * the memfd, and wait for it to be done.
+ *
+ * Not under the file lock: the fault may come from a read or write
+ * on this same file, copying to or from the mapping while holding
+ * it.  The call is sent under the device lock instead, like a
+ * polldiff, and fault transactions are matched apart from the ones
+ * syscalls restart, so neither can take the other's.
+ */
+static int fusd_fault_call(struct file *file, unsigned long offset,
+                           unsigned long length, int prot)
 {
 	fusd_dev_t *fusd_dev;
 	fusd_file_t *fusd_file;
-	fusd_msg_t fusd_msg, *reply = NULL;
-	int retval = -EPIPE, dir, length;
 	struct fusd_transaction *transaction;
+	fusd_msg_t fusd_msg;
+	int retval = 0;
 
 	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
 
-	if (ZOMBIE(fusd_dev))
-		goto zombie_dev;
-
-	LOCK_FUSD_FILE(fusd_file);
-
-	RDEBUG(3, "got an ioctl on /dev/%s (owned by pid %d) from pid %d",
-	       NAME(fusd_dev), fusd_dev->pid, current->pid);
+	RDEBUG(5, "fault at %lu (+%lu, prot %d) on /dev/%s from pid %d",
+	       offset, length, prot, NAME(fusd_dev), current->pid);
 
-	dir = _IOC_DIR(cmd);
-	length = _IOC_SIZE(cmd);
+	LOCK_FUSD_DEV(fusd_dev);
 
-	transaction = fusd_find_incomplete_transaction(fusd_file, FUSD_IOCTL);
-	// todo: Check to make sure the transaction is for the same IOCTL
+	/* a fault interrupted by a signal comes back here once it's
+	 * handled, and picks up its reply */
+	transaction = fusd_find_fault_transaction(fusd_file);
+	if (transaction && (transaction->offset != offset || transaction->size != length ||
+	                    transaction->prot != prot)) {
+		/* left over from a fault that gave up (or from a write
+		 * notification); its reply is no use for this one */
+		RDEBUG(2, "Incomplete fault transaction %ld at %lu thrown out, "
+		          "this fault is at %lu", transaction->transid,
+		       transaction->offset, offset);
+		fusd_cleanup_transaction(fusd_file, transaction);
+		transaction = NULL;
+	}
 
 	if (transaction == NULL) {
-		/* if we're trying to read or write, make sure length is sane */
-		if ((dir & (_IOC_WRITE | _IOC_READ)) &&
-		    (length <= 0 || length > MAX_RW_SIZE)) {
-			RDEBUG(2, "client ioctl got crazy IOC_SIZE of %d", length);
-			retval = -EINVAL;
-			goto done;
-		}
-
-		/* fill the struct */
 		init_fusd_msg(&fusd_msg);
-		fusd_msg.subcmd = FUSD_IOCTL;
-		fusd_msg.parm.fops_msg.cmd = cmd;
-		fusd_msg.parm.fops_msg.arg.arg = arg;
-
-		/* get the data if user is trying to write to the driver */
-		if (dir & _IOC_WRITE) {
-			if ((fusd_msg.data = VMALLOC(length)) == NULL) {
-				RDEBUG(2, "can't vmalloc for client ioctl!");
-				retval = -ENOMEM;
-				goto done;
-			}
-
-			if (copy_from_user(fusd_msg.data, (void *) arg, length)) {
-				retval = -EFAULT;
-				goto done;
-			}
-			fusd_msg.datalen = length;
-		}
-
-		/* send request to the driver */
-		if ((retval = fusd_fops_call_send(fusd_file, &fusd_msg, &transaction)) < 0)
-			goto done;
-	}
-	/* get the response */
-	/* todo: fix transid on restart */
-	if ((retval = fusd_fops_call_wait(fusd_file, &reply, transaction)) < 0 || reply == NULL)
-		goto done;
+		fusd_msg.subcmd = FUSD_FAULT;
+		fusd_msg.parm.fops_msg.mmoffset = offset;
+		fusd_msg.parm.fops_msg.length = length;
+		fusd_msg.parm.fops_msg.mmprot = prot;
 
-	/* if user is trying to read from the driver, copy data back */
-	if (dir & _IOC_READ) {
-		if (reply->data == NULL || reply->datalen != length) {
-			RDEBUG(2, "client_ioctl read reply with screwy data (%d, %d)",
-			       reply->datalen, length);
-			retval = -EIO;
-			goto done;
-		}
-		if (copy_to_user((void *) arg, reply->data, length)) {
-			retval = -EFAULT;
-			goto done;
+		if ((retval = __fusd_fops_call_send(fusd_file, &fusd_msg, &transaction, 1)) == 0) {
+			transaction->offset = offset;
+			transaction->prot = prot;
 		}
 	}
+	UNLOCK_FUSD_DEV(fusd_dev);
 
-	/* all done! */
-done:
-	free_fusd_msg(&reply);
-	UNLOCK_FUSD_FILE(fusd_file);
-	return retval;
+	if (retval < 0)
+		return retval;
+	return __fusd_fops_call_wait(fusd_file, NULL, transaction, 0);
 
 invalid_file:
-invalid_dev :
+invalid_dev:
 zombie_dev:
-	RDEBUG(3, "got an ioctl on client file from pid %d, driver has disappeared",
-	       current->pid);
 	return -EPIPE;
 }
 
-static void fusd_client_mm_open(struct vm_area_struct *vma);
-
-static void fusd_client_mm_close(struct vm_area_struct *vma);
+/* what a fault returns when the driver couldn't help */
+static vm_fault_t fusd_fault_error(struct vm_fault *vmf, int retval)
+{
+	/* a user fault is simply retried once the signal is handled; the
+	 * kernel's own accesses (copy_to_user and the like) would only
+	 * fault again right away, so they fail */
+	if (retval == -ERESTARTSYS && (vmf->flags & FAULT_FLAG_USER))
+		return VM_FAULT_NOPAGE;
+	if (retval == -ENOMEM)
+		return VM_FAULT_OOM;
+	return VM_FAULT_SIGBUS;
+}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
-static vm_fault_t fusd_client_fault (struct vm_fault *vmf);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
-static int fusd_client_fault (struct vm_fault *vmf);
-#elif LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 30)
-static int fusd_client_fault (struct vm_area_struct *vma, struct vm_fault *vmf);
-#else
-static int fusd_client_fault(struct vm_area_struct *vma, struct vm_fault *vmf, int *type);
-#endif
+static vm_fault_t fusd_fault_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct fusd_fault_instance *fault_instance = vma->vm_private_data;
+	struct address_space *mapping = vma->vm_file->f_mapping;
+	unsigned long npages, max;
+	int retval;
 
-static struct vm_operations_struct fusd_remap_vm_ops = {
-	.open = fusd_client_mm_open,
-	.close = fusd_client_mm_close,
-	.fault = fusd_client_fault,
-};
+	if (!fusd_fault_present(mapping, vmf->pgoff)) {
+		/* ask for the missing pages that follow it, too, in the
+		 * same round trip */
+		max = min_t(unsigned long, FUSD_MMAP_FAULT_AROUND,
+		            vma_pages(vma) - (vmf->pgoff - vma->vm_pgoff));
+		for (npages = 1; npages < max; npages++)
+			if (fusd_fault_present(mapping, vmf->pgoff + npages))
+				break;
+
+		retval = fusd_fault_call(fault_instance->file, vmf->pgoff << PAGE_SHIFT,
+		                         npages << PAGE_SHIFT,
+		                         PROT_READ | ((vmf->flags & FAULT_FLAG_WRITE) ? PROT_WRITE : 0));
+		if (retval < 0)
+			return fusd_fault_error(vmf, retval);
+	}
 
-struct fusd_mmap_instance {
-    fusd_dev_t *fusd_dev;
-    fusd_file_t *fusd_file;
-    unsigned long addr;
-    unsigned long size;
-    atomic_t refcount;
-};
+	return fault_instance->backing_ops->fault(vmf);
+}
 
-static void fusd_client_mm_open(struct vm_area_struct *vma)
+static vm_fault_t fusd_fault_mkwrite(struct vm_fault *vmf)
 {
-	struct fusd_mmap_instance *mmap_instance = (struct fusd_mmap_instance *) vma->vm_private_data;
-	atomic_inc(&mmap_instance->refcount);
+	struct fusd_fault_instance *fault_instance = vmf->vma->vm_private_data;
+	int retval;
 
+	retval = fusd_fault_call(fault_instance->file, vmf->pgoff << PAGE_SHIFT,
+	                         PAGE_SIZE, PROT_WRITE);
+	if (retval < 0)
+		return fusd_fault_error(vmf, retval);
+
+	/* the core locks the page and makes sure it's still there */
+	return 0;
 }
 
-static void fusd_client_mm_close(struct vm_area_struct *vma)
+/* forward the faults of a vma just handed over to a memfd (see
+ * fusd_mmap_file) to the driver, who opened it from file */
+static int fusd_fault_setup(struct vm_area_struct *vma, struct file *file, int mkwrite)
 {
-	struct fusd_mmap_instance *mmap_instance = (struct fusd_mmap_instance *) vma->vm_private_data;
-	if (atomic_dec_and_test(&mmap_instance->refcount)) {
-		KFREE(mmap_instance);
-	}
+	struct fusd_fault_instance *fault_instance;
+
+	if (vma->vm_ops == NULL || vma->vm_ops->fault == NULL)
+		return -EINVAL;
+
+	fault_instance = KMALLOC(sizeof(struct fusd_fault_instance), GFP_KERNEL);
+	if (fault_instance == NULL)
+		return -ENOMEM;
+
+	fault_instance->file = get_file(file);
+	fault_instance->backing_ops = vma->vm_ops;
+	atomic_set(&fault_instance->refcount, 1);
+
+	vma->vm_private_data = fault_instance;
+	/* set before mmap_region decides whether writes need notifying */
+	vma->vm_ops = mkwrite ? &fusd_fault_mkwrite_vm_ops : &fusd_fault_vm_ops;
+	return 0;
 }
+#endif /* CONFIG_FUSD_MMAP_FAULT */
 
 static int fusd_client_mmap(struct file *file, struct vm_area_struct *vma)
 {
@@ -1667,11 +4241,22 @@ static int fusd_client_mmap(struct file *file, struct vm_area_struct *vma)
 	if (ZOMBIE(fusd_dev))
 		goto zombie_dev;
 
+	if (!FUSD_DEV_HAS(fusd_dev, FUSD_CAP_MMAP))
+		return -ENOSYS;
+
 	LOCK_FUSD_FILE(fusd_file);
 
 	RDEBUG(3, "got a mmap on /dev/%s (owned by pid %d) from pid %d",
 	       NAME(fusd_dev), fusd_dev->pid, current->pid);
 
+	/* the driver sees it after the writes made before it */
+	if (fusd_file->wb_len > 0 || fusd_file->wb_transaction != NULL) {
+		if ((retval = fusd_wb_flush(fusd_file)) == 0)
+			retval = fusd_wb_error(fusd_file);
+		if (retval < 0)
+			goto done;
+	}
+
 	transaction = fusd_find_incomplete_transaction(fusd_file, FUSD_MMAP);
 
 	if (transaction == NULL) {
@@ -1698,30 +4283,58 @@ static int fusd_client_mmap(struct file *file, struct vm_area_struct *vma)
 
 	/* and wait for the reply */
 	/* todo: store and retrieve the transid from the interrupted message */
-	retval = fusd_fops_call_wait(fusd_file, &reply, transaction);
+	if ((retval = fusd_fops_call_wait(fusd_file, &reply, transaction)) < 0 || reply == NULL)
+		goto done;
+
+	/* the driver answered with a file: map that instead */
+	if (reply->parm.fops_msg.mmflags & FUSD_MMAP_FILE) {
+		retval = fusd_mmap_file(vma, (struct file *) reply->parm.fops_msg.arg.ptr_arg,
+		                        reply->parm.fops_msg.mmoffset);
+#ifdef CONFIG_FUSD_MMAP_FAULT
+		if (retval == 0 && (fusd_dev->flags & FUSD_DEV_MMAP_FAULT) &&
+		    FUSD_DEV_HAS(fusd_dev, FUSD_CAP_FAULT))
+			retval = fusd_fault_setup(vma, file, fusd_dev->flags & FUSD_DEV_MMAP_MKWRITE);
+#endif
+		goto done;
+	}
 
+	/* freed once the last vma using it is closed (see
+	 * fusd_client_mm_close) */
 	mmap_instance =
 		(struct fusd_mmap_instance *) KMALLOC(sizeof(struct fusd_mmap_instance), GFP_KERNEL);
-	// todo: free this thing at some point
+	if (mmap_instance == NULL) {
+		retval = -ENOMEM;
+		goto done;
+	}
 
 	mmap_instance->fusd_dev = fusd_dev;
 	mmap_instance->fusd_file = fusd_file;
+	get_file(file);
+	mmap_instance->file = file;
 	mmap_instance->addr = reply->parm.fops_msg.arg.arg;
 	mmap_instance->size = reply->parm.fops_msg.length;
+	mmap_instance->offset = vma->vm_pgoff << PAGE_SHIFT;
+	mmap_instance->length = vma->vm_end - vma->vm_start;
 	atomic_set(&mmap_instance->refcount, 0);
-
-	retval = reply->parm.fops_msg.retval;
+	FUSD_INIT_WORK(&mmap_instance->unmap_work, fusd_client_unmap_work);
 
 	vma->vm_private_data = mmap_instance;
 	vma->vm_ops = &fusd_remap_vm_ops;
+	/* the driver's pages are mapped in with vm_insert_page, from the
+	 * fault handler too */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0)
-	vma->vm_flags |= (VM_DONTEXPAND | VM_DONTDUMP);
+	vma->vm_flags |= (VM_DONTEXPAND | VM_DONTDUMP | VM_MIXEDMAP);
 #else
-	vma->vm_flags |= VM_RESERVED;
+	vma->vm_flags |= (VM_RESERVED | VM_MIXEDMAP);
 #endif
 
 	fusd_client_mm_open(vma);
 
+	/* map it all in now if the driver wants that -- unless it's the
+	 * driver mapping its own device, whose mm we hold */
+	if ((fusd_dev->flags & FUSD_DEV_MMAP_POPULATE) && fusd_dev->task->mm != current->mm)
+		fusd_mmap_insert(vma, vma->vm_start, fusd_mmap_pages(vma, vma->vm_start), NULL, NULL);
+
 done:
 	free_fusd_msg(&reply);
 	UNLOCK_FUSD_FILE(fusd_file);
@@ -1750,46 +4363,112 @@ static int fusd_client_fault(struct vm_area_struct *vma, struct vm_fault *vmf, i
 	struct vm_area_struct *vma = vmf->vma;
 #endif
 
-	struct fusd_mmap_instance *mmap_instance = (struct fusd_mmap_instance *) vma->vm_private_data;
-	unsigned long offset;
-	struct page *page = NULL;
+	unsigned long addr, around_start, around_pages, pages;
 	int result;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
-	offset = ( (unsigned long) vmf->address - vma->vm_start ) + ( vma->vm_pgoff << PAGE_SHIFT );
+	addr = (unsigned long) vmf->address & PAGE_MASK;
 #else
-	offset = ((unsigned long) vmf->virtual_address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+	addr = (unsigned long) vmf->virtual_address & PAGE_MASK;
 #endif
 
-	// todo: worry about size
-	if (offset > mmap_instance->size) {
+	if (fusd_mmap_pages(vma, addr) == 0) {
 		RDEBUG(2,
 		       "Current offset bigger than block size: cannot accept");
-		goto out;
+		return VM_FAULT_SIGBUS;
 	}
 
-	down_read(&mmap_instance->fusd_dev->task->mm->mmap_sem);
-	result = GET_USER_PAGES(mmap_instance->fusd_dev->task, mmap_instance->fusd_dev->task->mm,
-	                        mmap_instance->addr + offset, 1, 1, 0, &page, NULL);
-	up_read(&mmap_instance->fusd_dev->task->mm->mmap_sem);
+	/* the page we need... */
+	if ((result = fusd_mmap_insert(vma, addr, 1, &around_start, &around_pages)) < 0)
+		return result == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
 
+	/* ...and those around it, which will likely be needed next: on
+	 * a sequential pass through the buffer, this saves all but one
+	 * fault in FUSD_MMAP_FAULT_AROUND, or per huge page */
+	if (around_start < vma->vm_start) {
+		around_pages -= (vma->vm_start - around_start) >> PAGE_SHIFT;
+		around_start = vma->vm_start;
+	}
+	pages = fusd_mmap_pages(vma, around_start);
+	fusd_mmap_insert(vma, around_start, min(around_pages, pages), NULL, NULL);
 
-	if (PageAnon(page)) {
-		RDEBUG(2, "Cannot mmap non anonymous pages: The server is sharing a private page.\n"
-	                  "Be sure to allocate your shared buffer with mmap and  MAP_SHARED | MAP_ANONYMOUS as flags.");
-		return VM_FAULT_SIGBUS;
+	return VM_FAULT_NOPAGE;
+}
+
+/* convert a cached poll state (FUSD_NOTIFY_*) to the kernel's bits */
+static inline unsigned int fusd_poll_bits(int poll_state)
+{
+	unsigned int kernel_bits = 0;
+
+	if (poll_state > 0) {
+		if (poll_state & FUSD_NOTIFY_INPUT)
+			kernel_bits |= POLLIN;
+		if (poll_state & FUSD_NOTIFY_OUTPUT)
+			kernel_bits |= POLLOUT;
+		if (poll_state & FUSD_NOTIFY_EXCEPT)
+			kernel_bits |= POLLPRI;
 	}
+	return kernel_bits;
+}
 
-	if (result > 0) {
-		get_page(page);
-		vmf->page = page;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 30)
-		if ( type )
-		   *type = VM_FAULT_MINOR;
-#endif
+/*
+ * fusd_send_polldiff: if the driver doesn't already have a polldiff
+ * request for the state we have cached, send it one.  Called without
+ * the file lock; of several concurrent callers, only the one that wins
+ * the cmpxchg on last_poll_sent sends it.
+ *
+ * Don't send a new polldiff if the most recent one resulted in an
+ * error, or if the driver has no poll_diff callback at all.
+ */
+static void fusd_send_polldiff(fusd_file_t *fusd_file, int locked)
+{
+	fusd_dev_t *fusd_dev = fusd_file->fusd_dev;
+	fusd_msg_t fusd_msg;
+	int poll_state = atomic_read(&fusd_file->cached_poll_state);
+	int last_sent = atomic_read(&fusd_file->last_poll_sent);
+
+	if (last_sent == poll_state || poll_state < 0 || fusd_file->file == NULL ||
+	    !FUSD_DEV_HAS(fusd_dev, FUSD_CAP_POLL_DIFF))
+		return;
+
+	if (atomic_cmpxchg(&fusd_file->last_poll_sent, last_sent, poll_state) != last_sent)
+		return;
+
+	RDEBUG(3, "sending polldiff request because lps=%d, cps=%d",
+	       last_sent, poll_state);
+
+	init_fusd_msg(&fusd_msg);
+	fusd_msg.cmd = FUSD_FOPS_NONBLOCK;
+	fusd_msg.subcmd = FUSD_POLL_DIFF;
+	fusd_msg.parm.fops_msg.cmd = poll_state;
+	if (__fusd_fops_call_send(fusd_file, &fusd_msg, NULL, locked) < 0) {
+		/* If poll dispatched failed, set back to -1 so we try again.
+		 * Not a race (I think), since sending an *extra* polldiff never
+		 * hurts anything. */
+		atomic_set(&fusd_file->last_poll_sent, -1);
 	}
-out:
-	return 0;
+}
+
+/*
+ * fusd_notify_readiness: wake up whoever waits for one of the
+ * FUSD_NOTIFY_* bits that just became true: pollers interested in
+ * them, and owners that asked for SIGIO.
+ */
+static void fusd_notify_readiness(fusd_file_t *fusd_file, int new_bits)
+{
+	if (new_bits <= 0)
+		return;
+
+	WAKE_UP_POLL(&fusd_file->poll_wait, fusd_poll_bits(new_bits));
+
+	if (fusd_file->fasync == NULL)
+		return;
+	if (new_bits & FUSD_NOTIFY_INPUT)
+		kill_fasync(&fusd_file->fasync, SIGIO, POLL_IN);
+	if (new_bits & FUSD_NOTIFY_OUTPUT)
+		kill_fasync(&fusd_file->fasync, SIGIO, POLL_OUT);
+	if (new_bits & FUSD_NOTIFY_EXCEPT)
+		kill_fasync(&fusd_file->fasync, SIGIO, POLL_PRI);
 }
 
 /*
@@ -1805,86 +4484,175 @@ out:
  * the cached state.  We tell the kernel's select to sleep on our
  * poll_wait wait queue.
  *
- * When the driver replies, we update our cached info and wake up the
- * wait queue.  Waking up the wait queue will most likely immediately
- * effect a poll again, in which case we will reply whatever we just
- * cached from the driver.
+ * When the driver replies, we update our cached info, immediately
+ * dispatch the next polldiff if anyone is still polling (or wants
+ * SIGIO, see fusd_client_fasync), and wake up
+ * the wait queue -- but only the pollers waiting for one of the bits
+ * that are now set (a keyed wakeup), and only one at a time of those
+ * that asked for EPOLLEXCLUSIVE.  Having the kernel send the next
+ * polldiff means that pollers that aren't woken don't leave the
+ * driver without an outstanding request.
+ *
+ * Poll takes neither the file nor the device lock: read, write and
+ * ioctl hold the file lock for a whole round trip to the driver, and
+ * an event loop must not stall on a file just because a read on it is
+ * parked.  The cached state is read atomically, and which poller
+ * sends the next polldiff is decided by a compare-and-swap on
+ * last_poll_sent.
  * 
  */
 static unsigned int fusd_client_poll(struct file *file, poll_table *wait)
 {
 	fusd_dev_t *fusd_dev;
 	fusd_file_t *fusd_file;
-	int kernel_bits = 0;
-	int send_poll = 0;
+	int poll_state;
 
 	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
-	LOCK_FUSD_FILE(fusd_file);
-	LOCK_FUSD_DEV(fusd_dev);
-
-	RDEBUG(3, "got a select on /dev/%s (owned by pid %d) from pid %d, cps=%d",
-	       NAME(fusd_dev), fusd_dev->pid, current->pid,
-	       fusd_file->cached_poll_state);
+	if (ZOMBIE(fusd_dev))
+		goto zombie_dev;
 
 	poll_wait(file, &fusd_file->poll_wait, wait);
 
+	/* read the state only after we're on the wait queue, so an update
+	 * made in between is sure to wake us */
+	poll_state = atomic_read(&fusd_file->cached_poll_state);
+
+	RDEBUG(3, "got a select on /dev/%s (owned by pid %d) from pid %d, cps=%d",
+	       NAME(fusd_dev), fusd_dev->pid, current->pid, poll_state);
+
 	/*
 	 * If our currently cached poll state is not the same as the
 	 * most-recently-sent polldiff request, then, dispatch a new
 	 * request.  (We DO NOT wait for a reply, but just dispatch the
 	 * request).
-	 *
-	 * Also, don't send a new polldiff if the most recent one resulted
-	 * in an error.
 	 */
-	if (fusd_file->last_poll_sent != fusd_file->cached_poll_state &&
-	    fusd_file->cached_poll_state >= 0) {
-		RDEBUG(3, "sending polldiff request because lps=%d, cps=%d",
-		       fusd_file->last_poll_sent, fusd_file->cached_poll_state);
-		send_poll = 1;
-		fusd_file->last_poll_sent = fusd_file->cached_poll_state;
-	}
-
-	/* compute what to return for the state we had cached, converting to
-	 * bits that have meaning to the kernel */
-	if (fusd_file->cached_poll_state > 0) {
-		if (fusd_file->cached_poll_state & FUSD_NOTIFY_INPUT)
-			kernel_bits |= POLLIN;
-		if (fusd_file->cached_poll_state & FUSD_NOTIFY_OUTPUT)
-			kernel_bits |= POLLOUT;
-		if (fusd_file->cached_poll_state & FUSD_NOTIFY_EXCEPT)
-			kernel_bits |= POLLPRI;
+	fusd_send_polldiff(fusd_file, 0);
+
+	/* return the state we had cached, converted to bits that have
+	 * meaning to the kernel; data read ahead or pushed into the
+	 * stream ring is readable too */
+	if (fusd_file->ra_len > 0 || fusd_file->stream_len > 0 || fusd_file->stream_eof)
+		poll_state = (poll_state < 0 ? 0 : poll_state) | FUSD_NOTIFY_INPUT;
+
+	/* writes are buffered while there's room */
+	if (FUSD_WRITE_BEHIND(fusd_dev) && fusd_file->wb_len < FUSD_WB_SIZE)
+		poll_state = (poll_state < 0 ? 0 : poll_state) | FUSD_NOTIFY_OUTPUT;
+
+	return fusd_poll_bits(poll_state);
+
+zombie_dev:
+invalid_dev:
+invalid_file:
+	RDEBUG(3, "got a select on client file from pid %d, driver has disappeared",
+	       current->pid);
+	return POLLPRI;
+}
+
+/*
+ * fsync: only write-behind devices have anything to sync.  Waits for
+ * the driver to have replied to every write made so far.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+static int fusd_client_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+static int fusd_client_fsync(struct file *file, int datasync)
+#else
+static int fusd_client_fsync(struct file *file, struct dentry *dentry, int datasync)
+#endif
+{
+	fusd_dev_t *fusd_dev;
+	fusd_file_t *fusd_file;
+	int retval;
+
+	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
+
+	LOCK_FUSD_FILE(fusd_file);
+	if ((retval = fusd_wb_flush(fusd_file)) == 0)
+		retval = fusd_wb_error(fusd_file);
+	UNLOCK_FUSD_FILE(fusd_file);
+	return retval;
+
+invalid_dev:
+invalid_file:
+	return -EPIPE;
+}
+
+/*
+ * llseek is handled entirely in the kernel: the file position is
+ * passed to the driver with every read and write anyway.  SEEK_END
+ * needs the driver to have published the size of the file, and a
+ * driver can declare its files unseekable.
+ */
+static loff_t fusd_client_llseek(struct file *file, loff_t offset, int whence)
+{
+	fusd_dev_t *fusd_dev;
+	fusd_file_t *fusd_file;
+	unsigned int meta_valid;
+	loff_t size;
+	int seekable;
+
+	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
+
+	spin_lock(&fusd_file->meta_lock);
+	meta_valid = fusd_file->meta_valid;
+	seekable = fusd_file->meta_seekable;
+	size = fusd_file->meta_size;
+	spin_unlock(&fusd_file->meta_lock);
+
+	if ((meta_valid & FUSD_META_SEEKABLE) && !seekable)
+		return -ESPIPE;
+
+	switch (whence) {
+		case SEEK_SET:
+			break;
+		case SEEK_CUR:
+			offset += file->f_pos;
+			break;
+		case SEEK_END:
+			if (!(meta_valid & FUSD_META_SIZE))
+				return -EINVAL;
+			offset += size;
+			break;
+		default:
+			return -EINVAL;
 	}
 
-	/* Now that we've committed to sending the poll, etc., it should be
-	 * safe to unlock the device */
-	UNLOCK_FUSD_DEV(fusd_dev);
-	UNLOCK_FUSD_FILE(fusd_file);
+	if (offset < 0)
+		return -EINVAL;
+
+	file->f_pos = offset;
+	return offset;
+
+invalid_dev:
+invalid_file:
+	return -EPIPE;
+}
+
+/*
+ * fasync: the client wants SIGIO when the file becomes readable or
+ * writable.  That information only arrives in polldiff replies (or is
+ * pushed by the driver), so while anyone has asked for it we keep a
+ * polldiff outstanding even if nobody is in select().
+ */
+static int fusd_client_fasync(int fd, struct file *file, int on)
+{
+	fusd_dev_t *fusd_dev;
+	fusd_file_t *fusd_file;
+	int retval;
+
+	GET_FUSD_FILE_AND_DEV(file->private_data, fusd_file, fusd_dev);
 
-	if (send_poll) {
-		fusd_msg_t fusd_msg;
+	if ((retval = fasync_helper(fd, file, on, &fusd_file->fasync)) < 0)
+		return retval;
 
-		init_fusd_msg(&fusd_msg);
-		fusd_msg.cmd = FUSD_FOPS_NONBLOCK;
-		fusd_msg.subcmd = FUSD_POLL_DIFF;
-		fusd_msg.parm.fops_msg.cmd = fusd_file->cached_poll_state;
-		if (fusd_fops_call_send(fusd_file, &fusd_msg, NULL) < 0) {
-			/* If poll dispatched failed, set back to -1 so we try again.
-			 * Not a race (I think), since sending an *extra* polldiff never
-			 * hurts anything. */
-			fusd_file->last_poll_sent = -1;
-		}
-	}
-	return kernel_bits;
+	if (on && !ZOMBIE(fusd_dev))
+		fusd_send_polldiff(fusd_file, 0);
+
+	return 0;
 
-zombie_dev:
-	/* might jump here from LOCK_FUSD_DEV */
-	UNLOCK_FUSD_FILE(fusd_file);
 invalid_dev:
 invalid_file:
-	RDEBUG(3, "got a select on client file from pid %d, driver has disappeared",
-	       current->pid);
-	return POLLPRI;
+	return -EPIPE;
 }
 
 #ifndef HAVE_UNLOCKED_IOCTL
@@ -1892,10 +4660,13 @@ static struct file_operations fusd_client_fops = {
 	.owner = THIS_MODULE,
 	.open =  fusd_client_open,
 	.release = fusd_client_release,
+	.llseek = fusd_client_llseek,
 	.read = fusd_client_read,
 	.write = fusd_client_write,
 	.ioctl = fusd_client_ioctl,
 	.poll = fusd_client_poll,
+	.fsync = fusd_client_fsync,
+	.fasync = fusd_client_fasync,
 	.mmap = fusd_client_mmap
 };
 #else
@@ -1903,10 +4674,17 @@ static struct file_operations fusd_client_fops = {
 						  .owner = THIS_MODULE,
 						  .open =  fusd_client_open,
 						  .release = fusd_client_release,
+						  .llseek = fusd_client_llseek,
 						  .read = fusd_client_read,
 						  .write = fusd_client_write,
 						  .unlocked_ioctl = fusd_client_unlocked_ioctl,
 						  .poll = fusd_client_poll,
+						  .fsync = fusd_client_fsync,
+						  .fasync = fusd_client_fasync,
+#ifdef CONFIG_FUSD_SPLICE
+						  .splice_read = fusd_client_splice_read,
+						  .splice_write = fusd_client_splice_write,
+#endif
 						  .mmap = fusd_client_mmap
 };
 #endif
@@ -1941,6 +4719,24 @@ static fusd_file_t *find_fusd_reply_file(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
 /* Process an incoming reply to a message dispatched by
  * fusd_fops_call.  Called by fusd_write when a driver writes to
  * /dev/fusd. */
+/* take a reference to the file a driver answered an mmap with
+ * (FUSD_MMAP_FD), or fail the mmap if it isn't one we can map */
+static void fusd_mmap_reply_file(fusd_msg_t *msg)
+{
+	struct file *backing = fget(msg->parm.fops_msg.cmd);
+
+	if (backing == NULL) {
+		msg->parm.fops_msg.retval = -EBADF;
+	} else if (!shmem_mapping(backing->f_mapping)) {
+		RDEBUG(2, "driver answered an mmap with a file that isn't shmem");
+		fput(backing);
+		msg->parm.fops_msg.retval = -EINVAL;
+	} else {
+		msg->parm.fops_msg.arg.ptr_arg = backing;
+		msg->parm.fops_msg.mmflags |= FUSD_MMAP_FILE;
+	}
+}
+
 static int fusd_fops_reply(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
 {
 	fusd_file_t *fusd_file;
@@ -1973,169 +4769,711 @@ static int fusd_fops_reply(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
 	       NAME(fusd_dev), msg->parm.fops_msg.transid,
 	       (int) msg->parm.fops_msg.retval);
 
+	/* an mmap answered with a file: look it up while the driver's fd
+	 * still means something */
+	if (msg->subcmd == FUSD_MMAP && msg->parm.fops_msg.retval >= 0 &&
+	    (msg->parm.fops_msg.mmflags & FUSD_MMAP_FD))
+		fusd_mmap_reply_file(msg);
+
 	transaction->msg_in = msg;
 	mb();
 
-	WAKE_UP_INTERRUPTIBLE_SYNC(&fusd_file->file_wait);
+	/* only the caller waiting for this reply needs to wake up */
+	WAKE_UP_INTERRUPTIBLE_SYNC(&transaction->wait);
+
+	/* nobody waits for write-behind writes: send the next one */
+	if (transaction == fusd_file->wb_transaction) {
+		fusd_file->wb_done = 1;
+		wake_up_interruptible(&fusd_file->file_wait);
+		schedule_delayed_work(&fusd_file->wb_work, 0);
+	}
+
+	return 0;
+
+discard:
+	if (msg->subcmd == FUSD_OPEN && msg->parm.fops_msg.retval == 0) {
+		fusd_forge_close(msg, fusd_dev);
+		return 0;
+	} else {
+		return -EPIPE;
+	}
+}
+
+/* special function to process responses to POLL_DIFF */
+static int fusd_polldiff_reply(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	fusd_file_t *fusd_file;
+	int poll_state;
+
+	/* figure out the index of the file we are replying to.  usually
+	 * very fast (uses a hint) */
+	if ((fusd_file = find_fusd_reply_file(fusd_dev, msg)) == NULL)
+		return -EPIPE;
+
+	/* record the poll state returned.  convert all negative retvals to -1. */
+	poll_state = msg->parm.fops_msg.retval < 0 ? -1 : msg->parm.fops_msg.retval;
+	atomic_set(&fusd_file->cached_poll_state, poll_state);
+
+	RDEBUG(3, "got updated poll state from /dev/%s driver: %d", NAME(fusd_dev),
+	       poll_state);
+
+	/* since the client has returned the polldiff we sent, set
+	 * last_poll_sent to -1, so that we'll send a polldiff request on
+	 * the next select. */
+	atomic_set(&fusd_file->last_poll_sent, -1);
+
+	/* if someone is still selecting or wants SIGIO, send the next
+	 * polldiff now rather than having every poller wake up to race
+	 * for it */
+	if (waitqueue_active(&fusd_file->poll_wait) || fusd_file->fasync != NULL)
+		fusd_send_polldiff(fusd_file, 1);
+
+	/* wake up the pollers that have something to do now */
+	if (poll_state < 0)
+		wake_up_interruptible(&fusd_file->poll_wait);
+	else
+		fusd_notify_readiness(fusd_file, poll_state);
+
+	return 0;
+}
+
+static int fusd_register_device(fusd_dev_t *fusd_dev,
+                                register_msg_t register_msg)
+{
+	int error = 0;
+	struct list_head *tmp;
+	int dev_id;
+
+	/* make sure args are valid */
+	if (fusd_dev == NULL) {
+		RDEBUG(0, "fusd_register_device: bug in arguments!");
+		return -EINVAL;
+	}
+
+	register_msg.name[FUSD_MAX_NAME_LENGTH] = '\0';
+
+	/* make sure that there isn't already a device by this name */
+	down(&fusd_devlist_sem);
+
+	list_for_each(tmp, &fusd_devlist_head)
+	{
+		fusd_dev_t *d = list_entry(tmp, fusd_dev_t, devlist);
+
+
+		if (d && d->name && !d->zombie && !strcmp(d->name, register_msg.name)) {
+			error = -EEXIST;
+			break;
+		}
+	}
+
+	up(&fusd_devlist_sem);
+
+	if (error)
+		return error;
+
+	/* allocate memory for the name, and copy */
+	if ((fusd_dev->name = KMALLOC(strlen(register_msg.name) + 1, GFP_KERNEL)) == NULL) {
+		RDEBUG(1, "yikes!  kernel can't allocate memory");
+		return -ENOMEM;
+	}
+
+	strcpy(fusd_dev->name, register_msg.name);
+
+	/* allocate memory for the class name, and copy */
+	if ((fusd_dev->class_name = KMALLOC(strlen(register_msg.clazz) + 1, GFP_KERNEL)) == NULL) {
+		RDEBUG(1, "yikes!  kernel can't allocate memory");
+		return -ENOMEM;
+	}
+
+	strcpy(fusd_dev->class_name, register_msg.clazz);
+
+	/* allocate memory for the class name, and copy */
+	if ((fusd_dev->dev_name = KMALLOC(strlen(register_msg.devname) + 1, GFP_KERNEL)) == NULL) {
+		RDEBUG(1, "yikes!  kernel can't allocate memory");
+		return -ENOMEM;
+	}
+
+	strcpy(fusd_dev->dev_name, register_msg.devname);
+
+	dev_id = 0;
+
+	if ((error = alloc_chrdev_region(&dev_id, 0, 1, fusd_dev->name)) < 0) {
+		printk(KERN_ERR "alloc_chrdev_region failed status: %d\n", error);
+		goto register_failed;
+	}
+
+	fusd_dev->dev_id = dev_id;
+
+	fusd_dev->handle = cdev_alloc();
+	if (fusd_dev->handle == NULL) {
+		printk(KERN_ERR "cdev_alloc() failed\n");
+		error = -ENOMEM;
+		goto register_failed3;
+	}
+
+	fusd_dev->handle->owner = THIS_MODULE;
+	fusd_dev->handle->ops = &fusd_client_fops;
+
+	kobject_set_name(&fusd_dev->handle->kobj, fusd_dev->name);
+
+	if ((error = cdev_add(fusd_dev->handle, dev_id, 1)) < 0) {
+		printk(KERN_ERR "cdev_add failed status: %d\n", error);
+		kobject_put(&fusd_dev->handle->kobj);
+		goto register_failed3;
+	}
+
+	fusd_dev->device = CLASS_DEVICE_CREATE(fusd_class, NULL, fusd_dev->dev_id, NULL, fusd_dev->dev_name);
+	if (fusd_dev->device == NULL) {
+		error = PTR_ERR(fusd_dev->device);
+		printk(KERN_ERR "device_create failed status: %d\n", error);
+		goto register_failed5;
+	}
+
+	/* make sure the registration was successful */
+	if (fusd_dev->handle == 0) {
+		error = -EIO;
+		goto register_failed;
+	}
+
+	/* remember the user's private data so we can pass it back later */
+	fusd_dev->private_data = register_msg.device_info;
+
+	/* and which callbacks the driver actually implements */
+	fusd_dev->caps = register_msg.caps;
+
+	/* everything ok */
+	fusd_dev->version = atomic_inc_and_ret(&last_version);
+	RDEBUG(3, "pid %d registered /dev/%s v%ld", fusd_dev->pid, NAME(fusd_dev),
+	       fusd_dev->version);
+	wake_up_interruptible(&new_device_wait);
+	return 0;
+
+register_failed5:
+	fusd_dev->clazz = NULL;
+
+	cdev_del(fusd_dev->handle);
+	fusd_dev->handle = NULL;
+register_failed3:
+	unregister_chrdev_region(dev_id, 1);
+register_failed:
+	KFREE(fusd_dev->name);
+	fusd_dev->name = NULL;
+	return error;
+}
+
+
+/*
+ * fusd_set_ioctl_ranges: replace the set of ioctl numbers the device
+ * accepts.  An empty set means "accept everything" again.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_set_ioctl_ranges(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	fusd_ioctl_range_t *ranges = NULL;
+	int i, num = msg->datalen / sizeof(fusd_ioctl_range_t);
+
+	if (msg->datalen % sizeof(fusd_ioctl_range_t) || num > FUSD_MAX_IOCTL_RANGES) {
+		RDEBUG(2, "/dev/%s sent a bad ioctl range list (%d bytes)",
+		       NAME(fusd_dev), msg->datalen);
+		return -EINVAL;
+	}
+
+	if (num > 0) {
+		ranges = (fusd_ioctl_range_t *) msg->data;
+		for (i = 0; i < num; i++)
+			if (ranges[i].first > ranges[i].last)
+				return -EINVAL;
+
+		if ((ranges = KMALLOC(msg->datalen, GFP_KERNEL)) == NULL) {
+			RDEBUG(1, "yikes!  kernel can't allocate memory");
+			return -ENOMEM;
+		}
+		memcpy(ranges, msg->data, msg->datalen);
+	}
+
+	if (fusd_dev->ioctl_ranges != NULL)
+		KFREE(fusd_dev->ioctl_ranges);
+	fusd_dev->ioctl_ranges = ranges;
+	fusd_dev->num_ioctl_ranges = num;
+
+	RDEBUG(3, "/dev/%s now accepts %d ioctl ranges", NAME(fusd_dev), num);
+	return 0;
+}
+
+/*
+ * fusd_set_flags: change the behavior flags of a device.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_set_flags(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	/* a flag we don't know is one we'd silently not honour */
+	if ((msg->parm.ctl_msg.set | msg->parm.ctl_msg.clear) & ~FUSD_DEV_ALL_FLAGS) {
+		RDEBUG(2, "/dev/%s: unknown flags 0x%x", NAME(fusd_dev),
+		       (msg->parm.ctl_msg.set | msg->parm.ctl_msg.clear) & ~FUSD_DEV_ALL_FLAGS);
+		return -EINVAL;
+	}
+
+	fusd_dev->flags &= ~msg->parm.ctl_msg.clear;
+	fusd_dev->flags |= msg->parm.ctl_msg.set;
+
+	if (!(fusd_dev->flags & FUSD_DEV_PAGE_CACHE))
+		fusd_cache_invalidate(fusd_dev, 0, 0);
+
+	RDEBUG(3, "/dev/%s flags now 0x%x", NAME(fusd_dev), fusd_dev->flags);
+	return 0;
+}
+
+/*
+ * fusd_set_open_policy: install (or, with no data, remove) the open
+ * policy of a device.  Any cached verdicts are forgotten.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_set_open_policy(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	fusd_open_policy_t *policy = NULL;
+	struct fusd_open_verdict *cache = NULL;
+
+	if (msg->datalen > 0) {
+		policy = (fusd_open_policy_t *) msg->data;
+
+		if (msg->datalen < sizeof(fusd_open_policy_t) ||
+		    policy->num_uids < 0 || policy->num_uids > FUSD_MAX_POLICY_IDS ||
+		    policy->num_gids < 0 || policy->num_gids > FUSD_MAX_POLICY_IDS ||
+		    msg->datalen != sizeof(fusd_open_policy_t) +
+		                    policy->num_uids * sizeof(uid_t) +
+		                    policy->num_gids * sizeof(gid_t)) {
+			RDEBUG(2, "/dev/%s sent a bad open policy (%d bytes)",
+			       NAME(fusd_dev), msg->datalen);
+			return -EINVAL;
+		}
+
+		if (policy->flags & FUSD_POLICY_CACHE) {
+			cache = KMALLOC(FUSD_OPEN_CACHE_SIZE * sizeof(struct fusd_open_verdict),
+			                GFP_KERNEL);
+			if (cache == NULL) {
+				RDEBUG(1, "yikes!  kernel can't allocate memory");
+				return -ENOMEM;
+			}
+			memset(cache, 0, FUSD_OPEN_CACHE_SIZE * sizeof(struct fusd_open_verdict));
+		}
 
+		if ((policy = KMALLOC(msg->datalen, GFP_KERNEL)) == NULL) {
+			RDEBUG(1, "yikes!  kernel can't allocate memory");
+			if (cache != NULL)
+				KFREE(cache);
+			return -ENOMEM;
+		}
+		memcpy(policy, msg->data, msg->datalen);
+	}
+
+	if (fusd_dev->open_policy != NULL)
+		KFREE(fusd_dev->open_policy);
+	if (fusd_dev->open_cache != NULL)
+		KFREE(fusd_dev->open_cache);
+	fusd_dev->open_policy = policy;
+	fusd_dev->open_cache = cache;
+	fusd_dev->open_cache_gen++;
+
+	RDEBUG(3, "/dev/%s %s its open policy", NAME(fusd_dev),
+	       policy ? "installed" : "removed");
+	return 0;
+}
+
+/*
+ * fusd_flush_open_cache: forget the cached open verdict of one uid,
+ * or of all of them if the uid is (uid_t) -1.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_flush_open_cache(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	uid_t uid = (uid_t) msg->parm.ctl_msg.id;
+	struct fusd_open_verdict *verdict;
+	int i;
+
+	/* opens already waiting on the driver must not store their
+	 * answers afterwards; they may have been given before the flush */
+	fusd_dev->open_cache_gen++;
+
+	if (fusd_dev->open_cache == NULL)
+		return 0;
+
+	if (uid == (uid_t) -1) {
+		for (i = 0; i < FUSD_OPEN_CACHE_SIZE; i++)
+			fusd_dev->open_cache[i].valid = 0;
+	} else {
+		for (i = 0; i <= O_ACCMODE; i++) {
+			verdict = FUSD_OPEN_VERDICT(fusd_dev, uid, i);
+			if (verdict->uid == uid && verdict->accmode == i)
+				verdict->valid = 0;
+		}
+	}
 	return 0;
+}
+
+/*
+ * fusd_file_set_readiness: update the poll state of a file on the
+ * driver's initiative, and wake up whoever is selecting on it.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static void fusd_file_set_readiness(fusd_file_t *fusd_file, unsigned int set,
+                                    unsigned int clear)
+{
+	int old_state, new_state;
+
+	/* whatever changed, data read ahead may no longer be current */
+	fusd_file->ra_stale = 1;
+
+	/* the file lock isn't held, so reads and writes may be clearing
+	 * bits behind our back */
+	do {
+		old_state = atomic_read(&fusd_file->cached_poll_state);
+
+		/* a pushed state replaces a polldiff error */
+		new_state = ((old_state < 0 ? 0 : old_state) & ~clear) | set;
+		new_state &= FUSD_NOTIFY_INPUT | FUSD_NOTIFY_OUTPUT | FUSD_NOTIFY_EXCEPT;
+
+		if (new_state == old_state)
+			return;
+	} while (atomic_cmpxchg(&fusd_file->cached_poll_state, old_state,
+	                        new_state) != old_state);
+
+	/* bits that went away wake nobody; bits that appeared wake only
+	 * those polling for them */
+	if (old_state < 0)
+		old_state = 0;
+	fusd_notify_readiness(fusd_file, new_state & ~old_state);
+}
+
+/*
+ * fusd_set_readiness: the driver tells us a file's poll state without
+ * having been asked, so clients can select on it without a polldiff
+ * round trip.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_set_readiness(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	int i;
 
-discard:
-	if (msg->subcmd == FUSD_OPEN && msg->parm.fops_msg.retval == 0) {
-		fusd_forge_close(msg, fusd_dev);
-		return 0;
-	} else {
+	if ((i = find_fusd_file(fusd_dev, msg->parm.ctl_msg.fusd_file)) < 0) {
+		RDEBUG(2, "/dev/%s set readiness of a file that's not open",
+		       NAME(fusd_dev));
 		return -EPIPE;
 	}
+
+	fusd_file_set_readiness(fusd_dev->files[i], msg->parm.ctl_msg.set,
+	                        msg->parm.ctl_msg.clear);
+
+	RDEBUG(3, "/dev/%s driver pushed poll state %d", NAME(fusd_dev),
+	       atomic_read(&fusd_dev->files[i]->cached_poll_state));
+	return 0;
 }
 
-/* special function to process responses to POLL_DIFF */
-static int fusd_polldiff_reply(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+/*
+ * fusd_set_group: put a file in one of the driver's groups, so that
+ * readiness can be broadcast to all of them at once.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_set_group(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
 {
-	fusd_file_t *fusd_file;
+	int i;
 
-	/* figure out the index of the file we are replying to.  usually
-	 * very fast (uses a hint) */
-	if ((fusd_file = find_fusd_reply_file(fusd_dev, msg)) == NULL)
+	if ((i = find_fusd_file(fusd_dev, msg->parm.ctl_msg.fusd_file)) < 0)
 		return -EPIPE;
 
-	/* record the poll state returned.  convert all negative retvals to -1. */
-	if ((fusd_file->cached_poll_state = msg->parm.fops_msg.retval) < 0)
-		fusd_file->cached_poll_state = -1;
-
-	RDEBUG(3, "got updated poll state from /dev/%s driver: %d", NAME(fusd_dev),
-	       fusd_file->cached_poll_state);
+	fusd_dev->files[i]->group = msg->parm.ctl_msg.id;
+	return 0;
+}
 
-	/* since the client has returned the polldiff we sent, set
-	 * last_poll_sent to -1, so that we'll send a polldiff request on
-	 * the next select. */
-	fusd_file->last_poll_sent = -1;
+/*
+ * fusd_broadcast_readiness: update the poll state of every open file
+ * in a group (or of every open file, for group 0) in one go.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_broadcast_readiness(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	unsigned int group = msg->parm.ctl_msg.id;
+	int i, count = 0;
 
-	/* wake up select's queue so that a new polldiff is generated */
-	wake_up_interruptible(&fusd_file->poll_wait);
+	for (i = 0; i < fusd_dev->num_files; i++) {
+		if (group != 0 && fusd_dev->files[i]->group != group)
+			continue;
+		fusd_file_set_readiness(fusd_dev->files[i], msg->parm.ctl_msg.set,
+		                        msg->parm.ctl_msg.clear);
+		count++;
+	}
 
+	RDEBUG(3, "/dev/%s driver pushed poll state +%x -%x to %d files",
+	       NAME(fusd_dev), msg->parm.ctl_msg.set, msg->parm.ctl_msg.clear, count);
 	return 0;
 }
 
-static int fusd_register_device(fusd_dev_t *fusd_dev,
-                                register_msg_t register_msg)
+/* apply a metadata update to one file.  DEVICE LOCK MUST BE HELD */
+static void fusd_file_set_meta(fusd_file_t *fusd_file, fusd_file_meta_t *meta,
+                               unsigned int clear)
 {
-	int error = 0;
-	struct list_head *tmp;
-	int dev_id;
+	spin_lock(&fusd_file->meta_lock);
+	fusd_file->meta_valid &= ~clear;
+	if (meta != NULL) {
+		if (meta->valid & FUSD_META_AVAIL)
+			fusd_file->meta_avail = meta->avail < 0 ? 0 : meta->avail;
+		if (meta->valid & FUSD_META_SIZE)
+			fusd_file->meta_size = meta->size < 0 ? 0 : meta->size;
+		if (meta->valid & FUSD_META_SEEKABLE)
+			fusd_file->meta_seekable = meta->seekable;
+		fusd_file->meta_valid |= meta->valid;
+	}
+	spin_unlock(&fusd_file->meta_lock);
 
-	/* make sure args are valid */
-	if (fusd_dev == NULL) {
-		RDEBUG(0, "fusd_register_device: bug in arguments!");
+	/* the size is this file's only: the inode is the device node,
+	 * shared by everyone who opened it, so it is not told */
+}
+
+/*
+ * fusd_set_file_meta: the driver publishes what a file has to read,
+ * how big it is and whether it can seek, for one file or (with a NULL
+ * file) all of them, so we can answer FIONREAD and lseek without
+ * asking it.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_set_file_meta(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	fusd_file_meta_t *meta = NULL;
+	int i;
+
+	if (msg->datalen != 0 && msg->datalen != sizeof(fusd_file_meta_t)) {
+		RDEBUG(2, "/dev/%s sent bad file metadata (%d bytes)",
+		       NAME(fusd_dev), msg->datalen);
 		return -EINVAL;
 	}
+	if (msg->datalen > 0)
+		meta = (fusd_file_meta_t *) msg->data;
 
-	register_msg.name[FUSD_MAX_NAME_LENGTH] = '\0';
+	if (msg->parm.ctl_msg.fusd_file == NULL) {
+		for (i = 0; i < fusd_dev->num_files; i++)
+			fusd_file_set_meta(fusd_dev->files[i], meta, msg->parm.ctl_msg.clear);
+		return 0;
+	}
 
-	/* make sure that there isn't already a device by this name */
-	down(&fusd_devlist_sem);
+	if ((i = find_fusd_file(fusd_dev, msg->parm.ctl_msg.fusd_file)) < 0)
+		return -EPIPE;
 
-	list_for_each(tmp, &fusd_devlist_head)
-	{
-		fusd_dev_t *d = list_entry(tmp, fusd_dev_t, devlist);
+	fusd_file_set_meta(fusd_dev->files[i], meta, msg->parm.ctl_msg.clear);
+	return 0;
+}
+
+/*
+ * fusd_invalidate_cache: the driver tells us part (or all) of what we
+ * cached for it is stale.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_invalidate_cache(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	fusd_cache_range_t *range = (fusd_cache_range_t *) msg->data;
+	int i;
 
+	/* what files read ahead is the driver's data too */
+	for (i = 0; i < fusd_dev->num_files; i++)
+		fusd_dev->files[i]->ra_stale = 1;
 
-		if (d && d->name && !d->zombie && !strcmp(d->name, register_msg.name)) {
-			error = -EEXIST;
-			break;
-		}
+	if (msg->datalen == 0) {
+		fusd_cache_invalidate(fusd_dev, 0, 0);
+		return 0;
 	}
 
-	up(&fusd_devlist_sem);
+	if (msg->datalen != sizeof(fusd_cache_range_t) ||
+	    range->offset < 0 || range->length < 0)
+		return -EINVAL;
 
-	if (error)
-		return error;
+	fusd_cache_invalidate(fusd_dev, range->offset, range->length);
+	return 0;
+}
 
-	/* allocate memory for the name, and copy */
-	if ((fusd_dev->name = KMALLOC(strlen(register_msg.name) + 1, GFP_KERNEL)) == NULL) {
-		RDEBUG(1, "yikes!  kernel can't allocate memory");
-		return -ENOMEM;
-	}
+/*
+ * fusd_set_readahead: change the largest read-ahead window of a
+ * device, 0 to turn read-ahead off.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_set_readahead(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	fusd_dev->ra_max = min_t(unsigned int, msg->parm.ctl_msg.id, MAX_RW_SIZE);
 
-	strcpy(fusd_dev->name, register_msg.name);
+	RDEBUG(3, "/dev/%s read-ahead window now up to %d bytes", NAME(fusd_dev),
+	       fusd_dev->ra_max);
+	return 0;
+}
 
-	/* allocate memory for the class name, and copy */
-	if ((fusd_dev->class_name = KMALLOC(strlen(register_msg.clazz) + 1, GFP_KERNEL)) == NULL) {
-		RDEBUG(1, "yikes!  kernel can't allocate memory");
-		return -ENOMEM;
-	}
+/*
+ * fusd_stream_push: the driver adds data to the stream ring of one
+ * file, or of every open file when none is given.  A file without room
+ * for all of it fails the push with -EAGAIN; when pushing to every
+ * file, files without room just miss this data, the way a slow reader
+ * of a broadcast would.
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_stream_push(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	int eof = (msg->parm.ctl_msg.set & FUSD_STREAM_EOF) != 0;
+	int i, retval;
 
-	strcpy(fusd_dev->class_name, register_msg.clazz);
+	if (msg->datalen > FUSD_STREAM_SIZE)
+		return -EINVAL;
 
-	/* allocate memory for the class name, and copy */
-	if ((fusd_dev->dev_name = KMALLOC(strlen(register_msg.devname) + 1, GFP_KERNEL)) == NULL) {
-		RDEBUG(1, "yikes!  kernel can't allocate memory");
-		return -ENOMEM;
+	if (msg->parm.ctl_msg.fusd_file == NULL) {
+		for (i = 0; i < fusd_dev->num_files; i++) {
+			retval = fusd_file_stream_push(fusd_dev->files[i], msg->data,
+			                               msg->datalen, eof);
+			if (retval < 0)
+				RDEBUG(3, "/dev/%s: stream push to a file dropped (%d)",
+				       NAME(fusd_dev), retval);
+		}
+		return 0;
 	}
 
-	strcpy(fusd_dev->dev_name, register_msg.devname);
-
-	dev_id = 0;
+	if ((i = find_fusd_file(fusd_dev, msg->parm.ctl_msg.fusd_file)) < 0)
+		return -EPIPE;
 
-	if ((error = alloc_chrdev_region(&dev_id, 0, 1, fusd_dev->name)) < 0) {
-		printk(KERN_ERR "alloc_chrdev_region failed status: %d\n", error);
-		goto register_failed;
-	}
+	return fusd_file_stream_push(fusd_dev->files[i], msg->data, msg->datalen, eof);
+}
 
-	fusd_dev->dev_id = dev_id;
+/*
+ * fusd_set_coalesce: change how long small writes may be held back
+ * to be merged on a FUSD_DEV_COALESCE device (at most a second).
+ *
+ * DEVICE LOCK MUST BE HELD
+ */
+static int fusd_set_coalesce(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	fusd_dev->coalesce_delay = min_t(unsigned long,
+	                                 usecs_to_jiffies(msg->parm.ctl_msg.id), HZ);
+	return 0;
+}
 
-	fusd_dev->handle = cdev_alloc();
-	if (fusd_dev->handle == NULL) {
-		printk(KERN_ERR "cdev_alloc() failed\n");
-		error = -ENOMEM;
-		goto register_failed3;
-	}
+/* FUSD_CTL_CACHE_IOCTL: mark an _IOR ioctl as one we may answer
+ * ourselves, with the answer that follows, or else the next one the
+ * driver gives */
+static int fusd_cache_ioctl(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	fusd_ioctl_cache_t *req = (fusd_ioctl_cache_t *) msg->data;
+	struct fusd_ioctl_answer *answer, *found = NULL;
+	int size, count = 0;
 
-	fusd_dev->handle->owner = THIS_MODULE;
-	fusd_dev->handle->ops = &fusd_client_fops;
+	if (req == NULL || msg->datalen < sizeof(fusd_ioctl_cache_t))
+		return -EINVAL;
 
-	kobject_set_name(&fusd_dev->handle->kobj, fusd_dev->name);
+	size = _IOC_SIZE(req->cmd);
+	if (_IOC_DIR(req->cmd) != _IOC_READ || size <= 0 || size > MAX_RW_SIZE)
+		return -EINVAL;
+	if (msg->datalen != sizeof(fusd_ioctl_cache_t) &&
+	    (msg->datalen != sizeof(fusd_ioctl_cache_t) + size || req->retval < 0))
+		return -EINVAL;
 
-	if ((error = cdev_add(fusd_dev->handle, dev_id, 1)) < 0) {
-		printk(KERN_ERR "cdev_add failed status: %d\n", error);
-		kobject_put(&fusd_dev->handle->kobj);
-		goto register_failed3;
+	list_for_each_entry(answer, &fusd_dev->ioctl_cache, list) {
+		if (answer->cmd == req->cmd) {
+			found = answer;
+			break;
+		}
+		count++;
 	}
 
-	fusd_dev->device = CLASS_DEVICE_CREATE(fusd_class, NULL, fusd_dev->dev_id, NULL, fusd_dev->dev_name);
-	if (fusd_dev->device == NULL) {
-		error = PTR_ERR(fusd_dev->device);
-		printk(KERN_ERR "device_create failed status: %d\n", error);
-		goto register_failed5;
+	if (found == NULL) {
+		if (count >= FUSD_MAX_CACHED_IOCTLS)
+			return -ENOSPC;
+		if ((found = KMALLOC(sizeof(struct fusd_ioctl_answer) + size, GFP_KERNEL)) == NULL)
+			return -ENOMEM;
+		memset(found, 0, sizeof(struct fusd_ioctl_answer));
+		found->cmd = req->cmd;
+		list_add(&found->list, &fusd_dev->ioctl_cache);
 	}
 
-	/* make sure the registration was successful */
-	if (fusd_dev->handle == 0) {
-		error = -EIO;
-		goto register_failed;
-	}
+	/* replies to calls in flight are no good to us any more */
+	fusd_dev->ioctl_cache_gen++;
 
-	/* remember the user's private data so we can pass it back later */
-	fusd_dev->private_data = register_msg.device_info;
+	found->ttl = req->ttl ? msecs_to_jiffies(req->ttl) : 0;
+	found->valid = 0;
+	if (msg->datalen > sizeof(fusd_ioctl_cache_t)) {
+		memcpy(found->data, req + 1, size);
+		found->retval = req->retval;
+		found->expires = jiffies + found->ttl;
+		found->valid = 1;
+	}
 
-	/* everything ok */
-	fusd_dev->version = atomic_inc_and_ret(&last_version);
-	RDEBUG(3, "pid %d registered /dev/%s v%ld", fusd_dev->pid, NAME(fusd_dev),
-	       fusd_dev->version);
-	wake_up_interruptible(&new_device_wait);
+	RDEBUG(5, "/dev/%s: ioctl 0x%x cacheable, %s", NAME(fusd_dev), req->cmd,
+	       found->valid ? "answer given" : "learning answer");
 	return 0;
+}
 
-register_failed5:
-	fusd_dev->clazz = NULL;
+/* FUSD_CTL_UNCACHE_IOCTL: drop the answer to one ioctl (or all of
+ * them), and with FUSD_UNCACHE_FORGET, stop answering it at all */
+static int fusd_uncache_ioctl(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	struct fusd_ioctl_answer *answer, *next;
+	unsigned int cmd = msg->parm.ctl_msg.id;
 
-	cdev_del(fusd_dev->handle);
-	fusd_dev->handle = NULL;
-register_failed3:
-	unregister_chrdev_region(dev_id, 1);
-register_failed:
-	KFREE(fusd_dev->name);
-	fusd_dev->name = NULL;
-	return error;
+	fusd_dev->ioctl_cache_gen++;
+
+	list_for_each_entry_safe(answer, next, &fusd_dev->ioctl_cache, list) {
+		if (cmd != 0 && answer->cmd != cmd)
+			continue;
+		if (msg->parm.ctl_msg.set & FUSD_UNCACHE_FORGET) {
+			list_del(&answer->list);
+			KFREE(answer);
+		} else {
+			answer->valid = 0;
+		}
+	}
+	return 0;
+}
+
+/* Process a FUSD_DEVICE_CONTROL message: the driver changing the way
+ * the kernel handles its device.  Called by fusd_process_write with
+ * the device locked. */
+static int fusd_device_control(fusd_dev_t *fusd_dev, fusd_msg_t *msg)
+{
+	switch (msg->subcmd) {
+		case FUSD_CTL_SET_IOCTL_RANGES:
+			return fusd_set_ioctl_ranges(fusd_dev, msg);
+		case FUSD_CTL_SET_FLAGS:
+			return fusd_set_flags(fusd_dev, msg);
+		case FUSD_CTL_SET_OPEN_POLICY:
+			return fusd_set_open_policy(fusd_dev, msg);
+		case FUSD_CTL_FLUSH_OPEN_CACHE:
+			return fusd_flush_open_cache(fusd_dev, msg);
+		case FUSD_CTL_SET_READINESS:
+			return fusd_set_readiness(fusd_dev, msg);
+		case FUSD_CTL_SET_GROUP:
+			return fusd_set_group(fusd_dev, msg);
+		case FUSD_CTL_BROADCAST_READINESS:
+			return fusd_broadcast_readiness(fusd_dev, msg);
+		case FUSD_CTL_SET_FILE_META:
+			return fusd_set_file_meta(fusd_dev, msg);
+		case FUSD_CTL_INVALIDATE_CACHE:
+			return fusd_invalidate_cache(fusd_dev, msg);
+		case FUSD_CTL_SET_READAHEAD:
+			return fusd_set_readahead(fusd_dev, msg);
+		case FUSD_CTL_STREAM_PUSH:
+			return fusd_stream_push(fusd_dev, msg);
+		case FUSD_CTL_SET_COALESCE:
+			return fusd_set_coalesce(fusd_dev, msg);
+		case FUSD_CTL_CACHE_IOCTL:
+			return fusd_cache_ioctl(fusd_dev, msg);
+		case FUSD_CTL_UNCACHE_IOCTL:
+			return fusd_uncache_ioctl(fusd_dev, msg);
+		default:
+			RDEBUG(2, "fusd_device_control got unknown subcmd %d", msg->subcmd);
+			return -EINVAL;
+	}
 }
 
 
@@ -2161,6 +5499,9 @@ static int fusd_open(struct inode *inode, struct file *file)
 		goto file_malloc_failed;
 
 	init_waitqueue_head(&fusd_dev->dev_wait);
+	INIT_RADIX_TREE(&fusd_dev->page_cache, GFP_ATOMIC);
+	INIT_LIST_HEAD(&fusd_dev->ioctl_cache);
+	fusd_dev->coalesce_delay = usecs_to_jiffies(FUSD_COALESCE_DELAY_DEFAULT);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 30)
 	init_MUTEX(&fusd_dev->dev_sem);
 #else
@@ -2228,7 +5569,7 @@ static int fusd_release(struct inode *inode, struct file *file)
 	zombify_dev(fusd_dev);
 
 	/* ...and possibly free it.  (Release lock if it hasn't been freed) */
-	if (!maybe_free_fusd_dev(fusd_dev))
+	if (!fusd_drop_released_files(fusd_dev) && !maybe_free_fusd_dev(fusd_dev))
 		UNLOCK_FUSD_DEV(fusd_dev);
 
 	/* notify fusd_status readers that there has been a change in the
@@ -2279,6 +5620,8 @@ static ssize_t fusd_process_write(struct file *file,
 		goto out;
 	}
 	msg->data = NULL; /* pointers from userspace have no meaning */
+	if (msg->cmd == FUSD_FOPS_REPLY) /* nor do the kernel's own flags */
+		msg->parm.fops_msg.mmflags &= ~FUSD_MMAP_FILE;
 
 	/* check the magic number before acting on the message at all */
 	if (msg->magic != FUSD_MSG_MAGIC) {
@@ -2294,7 +5637,10 @@ static ssize_t fusd_process_write(struct file *file,
 		retval = -EINVAL;
 		goto out;
 	}
-	if (msg->datalen != user_data_len) {
+	if (user_data_len == 0 && msg->datalen > 0 && msg->datalen <= FUSD_INLINE_MAX) {
+		/* the data came inline */
+		msg->data = msg->inline_data;
+	} else if (msg->datalen != user_data_len) {
 		RDEBUG(2, "%s : msg->datalen(%d) != user_data_len(%d), sigh!", __func__,
 		       msg->datalen, (int) user_data_len);
 		retval = -EINVAL;
@@ -2332,6 +5678,10 @@ static ssize_t fusd_process_write(struct file *file,
 			retval = fusd_register_device(fusd_dev, msg->parm.register_msg);
 			goto out;
 			break;
+		case FUSD_DEVICE_CONTROL:
+			retval = fusd_device_control(fusd_dev, msg);
+			goto out;
+			break;
 		case FUSD_FOPS_REPLY:
 			/* if reply is successful, DO NOT free the message */
 			if ((retval = fusd_fops_reply(fusd_dev, msg)) == 0) {
@@ -2358,7 +5708,7 @@ static ssize_t fusd_process_write(struct file *file,
 
 
 out:
-	if (msg && msg->data) {
+	if (msg && msg->data && msg->data != msg->inline_data) {
 		VFREE(msg->data);
 		msg->data = NULL;
 	}
@@ -2464,6 +5814,124 @@ static ssize_t fusd_aio_write (struct kiocb *iocb,
 }
 #endif
 
+/*
+ * fusd_client_copy: the driver reads or writes the memory of a client
+ * that is in the middle of a call to it -- to follow pointers in an
+ * ioctl argument, say, or to move more data than an ioctl's size
+ * field allows.  The call must be one of this device's, and still
+ * waiting for its reply, blocked on it.
+ *
+ * Returns the number of bytes copied; fewer than asked for if part of
+ * the client's range isn't mapped.
+ */
+#define FUSD_COPY_CHUNK (1024*64)
+
+static long fusd_client_copy(fusd_dev_t *fusd_dev, unsigned int cmd,
+                             fusd_client_copy_t __user *argp)
+{
+	fusd_client_copy_t copy;
+	struct fusd_transaction *transaction;
+	struct task_struct *task = NULL;
+	struct mm_struct *mm = NULL;
+	int write = (cmd == FUSD_COPY_TO_CLIENT);
+	unsigned long done = 0;
+	char *chunk = NULL;
+	long retval;
+	int i;
+
+	if (copy_from_user(&copy, argp, sizeof(copy)))
+		return -EFAULT;
+
+	/* find the call, which must have its caller blocked on it; hold
+	 * on to the caller and the memory it made the call with, not to
+	 * the call, which can go away as soon as we let go of the locks */
+	LOCK_FUSD_DEV(fusd_dev);
+	if ((i = find_fusd_file(fusd_dev, copy.fusd_file)) >= 0) {
+		fusd_file_t *fusd_file = fusd_dev->files[i];
+
+		down(&fusd_file->transactions_sem);
+		list_for_each_entry(transaction, &fusd_file->transactions, list) {
+			if (transaction->transid == copy.transid &&
+			    transaction->msg_in == NULL && transaction->mm != NULL &&
+			    transaction->waiting) {
+				task = transaction->task;
+				get_task_struct(task);
+				mm = transaction->mm;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+				mmget(mm);
+#else
+				atomic_inc(&mm->mm_users);
+#endif
+				break;
+			}
+		}
+		up(&fusd_file->transactions_sem);
+	}
+	UNLOCK_FUSD_DEV(fusd_dev);
+
+	if (task == NULL) {
+		RDEBUG(2, "/dev/%s: client copy for a call that isn't pending", NAME(fusd_dev));
+		return -ESRCH;
+	}
+
+	/* the driver gets no more than a debugger of its own would */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	if (!ptrace_may_access(task, PTRACE_MODE_ATTACH_REALCREDS)) {
+#else
+	if (!ptrace_may_access(task, PTRACE_MODE_ATTACH)) {
+#endif
+		RDEBUG(2, "/dev/%s: client copy refused, may not ptrace pid %d",
+		       NAME(fusd_dev), task->pid);
+		retval = -EPERM;
+		goto out;
+	}
+
+	if ((chunk = VMALLOC(min_t(unsigned long, copy.length, FUSD_COPY_CHUNK))) == NULL &&
+	    copy.length > 0) {
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	while (done < copy.length) {
+		int n = min_t(unsigned long, copy.length - done, FUSD_COPY_CHUNK);
+		int moved;
+
+		if (signal_pending(current))
+			break;
+
+		if (write && copy_from_user(chunk, (char __user *) copy.buf + done, n)) {
+			retval = -EFAULT;
+			goto out;
+		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
+		moved = access_remote_vm(mm, copy.client_addr + done, chunk, n,
+		                         write ? FOLL_WRITE : 0);
+#else
+		moved = access_remote_vm(mm, copy.client_addr + done, chunk, n, write);
+#endif
+		if (moved <= 0)
+			break;
+		if (!write && copy_to_user((char __user *) copy.buf + done, chunk, moved)) {
+			retval = -EFAULT;
+			goto out;
+		}
+		done += moved;
+		if (moved < n)
+			break;
+	}
+	retval = (done == 0 && copy.length > 0) ? -EFAULT : done;
+
+out:
+	if (chunk != NULL)
+		VFREE(chunk);
+	mmput(mm);
+	put_task_struct(task);
+	return retval;
+
+zombie_dev:
+	return -EPIPE;
+}
+
 #ifndef HAVE_UNLOCKED_IOCTL
 static int fusd_ioctl(struct inode *inode, struct file *file,
                       unsigned int cmd, unsigned long arg)
@@ -2472,11 +5940,15 @@ static long fusd_unlocked_ioctl (struct file *file,
 		       unsigned int cmd, unsigned long arg)
 #endif
 {
-#ifdef CONFIG_FUSD_DEBUG
 	void __user
 	*argp = (void
 	__user *) arg;
-#endif
+	fusd_dev_t *fusd_dev;
+
+	if (cmd == FUSD_COPY_FROM_CLIENT || cmd == FUSD_COPY_TO_CLIENT) {
+		GET_FUSD_DEV(file->private_data, fusd_dev);
+		return fusd_client_copy(fusd_dev, cmd, argp);
+	}
 
 #if 0
 	struct iovec iov;
@@ -2499,6 +5971,9 @@ static long fusd_unlocked_ioctl (struct file *file,
 
 	RDEBUG(2, "%s: got illegal ioctl #%08X# Or ARG is null [%p]", __func__, cmd, argp);
 	return -EINVAL;
+
+invalid_dev:
+	return -EPIPE;
 }
 
 /* fusd_read: a process is reading on /dev/fusd. return any messages
@@ -2627,9 +6102,9 @@ static ssize_t fusd_read(struct file *file,
 		/* this is a header read (first read) */
 		retval = fusd_read_header(user_buffer, user_length, &msg_out->fusd_msg);
 
-		/* is there data?  if so, make sure next read gets data.  if not,
-		 * make sure message is dequeued now.*/
-		if (msg_out->fusd_msg.datalen) {
+		/* is there data?  if so, make sure next read gets data.  if not
+		 * (or if it was inline), make sure message is dequeued now.*/
+		if (msg_out->fusd_msg.datalen && msg_out->fusd_msg.data != NULL) {
 			msg_out->peeked = 1;
 			dequeue = 0;
 		} else {
@@ -2643,11 +6118,19 @@ static ssize_t fusd_read(struct file *file,
 
 	/* if this message is done, take it out of the outgoing queue */
 	if (dequeue) {
+		fusd_file_t *release_file = msg_out->release_file;
+
 		if (fusd_dev->msg_tail == fusd_dev->msg_head)
 			fusd_dev->msg_tail = fusd_dev->msg_head = NULL;
 		else
 			fusd_dev->msg_head = msg_out->next;
 		FREE_FUSD_MSGC(msg_out);
+
+		/* the driver has now seen the close of an asynchronously
+		 * released file; its state can go.  (the device is not a
+		 * zombie, so it won't be freed along with it.) */
+		if (release_file != NULL)
+			free_fusd_file(fusd_dev, release_file);
 	}
 
 out:
@@ -2844,6 +6327,15 @@ static void fusd_status_build_text(fusd_statcontext_t *fs)
 		                "%6d %4d %s%s\n", d->pid, d->num_files,
 		                d->zombie ? "<zombie>" : "", NAME(d));
 
+		if (d->flags & FUSD_DEV_PAGE_CACHE)
+			len += snprintf(buf + len, buf_size - len,
+			                "            page cache: %lu hits, %lu misses\n",
+			                d->cache_hits, d->cache_misses);
+		if (FUSD_WRITE_BEHIND(d))
+			len += snprintf(buf + len, buf_size - len,
+			                "            write-behind: %lu writes in %lu messages\n",
+			                d->wb_writes, d->wb_msgs);
+
 		total_files++;
 		total_clients += d->num_files;
 	}
@@ -3082,6 +6574,10 @@ static int init_fusd(void)
 		goto fail10;
 	}
 
+#ifdef CONFIG_FUSD_CACHE_SHRINKER
+	fusd_cache_register_shrinker();
+#endif
+
 	RDEBUG(1, "registration successful");
 	return 0;
 
@@ -3110,6 +6606,10 @@ static void cleanup_fusd(void)
 {
 	RDEBUG(1, "cleaning up");
 
+#ifdef CONFIG_FUSD_CACHE_SHRINKER
+	fusd_cache_unregister_shrinker();
+#endif
+
 	CLASS_DEVICE_DESTROY(fusd_class, status_id);
 	CLASS_DEVICE_DESTROY(fusd_class, control_id);
 
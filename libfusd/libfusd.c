@@ -93,6 +93,42 @@ fusd_file_operations_t null_fops = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, N
    (memcmp(FUSD_GET_FOPS(fd), &null_fops, sizeof(fusd_file_operations_t))))
 
 
+/*
+ * fusd_fops_caps: compute the capability bits to declare to the
+ * kernel for a set of file operations, so it can complete
+ * operations we don't implement without asking us.
+ */
+static unsigned int fusd_fops_caps(const fusd_file_operations_t *fops)
+{
+  unsigned int caps = FUSD_CAP_DECLARED;
+
+  if (fops->open)
+    caps |= FUSD_CAP_OPEN;
+  if (fops->close)
+    caps |= FUSD_CAP_CLOSE;
+  if (fops->read)
+    caps |= FUSD_CAP_READ;
+  if (fops->write)
+    caps |= FUSD_CAP_WRITE;
+  if (fops->ioctl)
+    caps |= FUSD_CAP_IOCTL;
+  if (fops->poll_diff)
+    caps |= FUSD_CAP_POLL_DIFF;
+  if (fops->unblock)
+    caps |= FUSD_CAP_UNBLOCK;
+  if (fops->mmap)
+    caps |= FUSD_CAP_MMAP;
+  if (fops->stream_low)
+    caps |= FUSD_CAP_STREAM_LOW;
+  if (fops->fault)
+    caps |= FUSD_CAP_FAULT;
+  if (fops->munmap)
+    caps |= FUSD_CAP_MUNMAP;
+
+  return caps;
+}
+
+
 /*
  * fusd_init
  * 
@@ -190,6 +226,7 @@ int fusd_register(const char *name, const char* clazz, const char* devname, mode
   strcpy(message.parm.register_msg.devname, devname);
   message.parm.register_msg.mode = mode;
   message.parm.register_msg.device_info = device_info;
+  message.parm.register_msg.caps = fusd_fops_caps(fops);
 
   /* make the request */
   if (write(fd, &message, sizeof(fusd_msg_t)) < 0)
@@ -239,6 +276,357 @@ int fusd_unregister(int fd)
 }
 
 
+/*
+ * fusd_send_control: send a FUSD_DEVICE_CONTROL message, with an
+ * optional data part, to the kernel.
+ *
+ * On success, returns 0.
+ * On failure, returns -1 with errno set.
+ */
+static int fusd_send_control(int fd, fusd_msg_t *msg, const void *data,
+                             int datalen)
+{
+  struct iovec iov[2];
+  int ret;
+
+  if (!FUSD_FD_VALID(fd))
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  msg->magic = FUSD_MSG_MAGIC;
+  msg->cmd = FUSD_DEVICE_CONTROL;
+  msg->datalen = datalen;
+
+  if (datalen > 0 && datalen <= FUSD_INLINE_MAX)
+  {
+    memcpy(msg->inline_data, data, datalen);
+    ret = write(fd, msg, sizeof(fusd_msg_t));
+  }
+  else if (datalen > 0)
+  {
+    iov[0].iov_base = msg;
+    iov[0].iov_len = sizeof(fusd_msg_t);
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = datalen;
+    ret = writev(fd, iov, 2);
+  }
+  else
+  {
+    ret = write(fd, msg, sizeof(fusd_msg_t));
+  }
+
+  return ret < 0 ? -1 : 0;
+}
+
+
+int fusd_set_ioctl_ranges(int fd, const fusd_ioctl_range_t *ranges, int count)
+{
+  fusd_msg_t message;
+
+  if (count < 0 || count > FUSD_MAX_IOCTL_RANGES || (count && ranges == NULL))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_SET_IOCTL_RANGES;
+
+  return fusd_send_control(fd, &message, ranges,
+                           count * sizeof(fusd_ioctl_range_t));
+}
+
+
+int fusd_set_device_flags(int fd, unsigned int set, unsigned int clear)
+{
+  fusd_msg_t message;
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_SET_FLAGS;
+  message.parm.ctl_msg.set = set;
+  message.parm.ctl_msg.clear = clear;
+
+  return fusd_send_control(fd, &message, NULL, 0);
+}
+
+
+int fusd_set_open_policy(int fd, unsigned int flags, unsigned int cache_ttl,
+                         const uid_t *uids, int num_uids,
+                         const gid_t *gids, int num_gids)
+{
+  fusd_msg_t message;
+  fusd_open_policy_t *policy;
+  int len, ret;
+
+  if (num_uids < 0 || num_uids > FUSD_MAX_POLICY_IDS || (num_uids && uids == NULL) ||
+      num_gids < 0 || num_gids > FUSD_MAX_POLICY_IDS || (num_gids && gids == NULL))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_SET_OPEN_POLICY;
+
+  /* an empty policy removes the current one */
+  if (flags == 0 && num_uids == 0 && num_gids == 0)
+    return fusd_send_control(fd, &message, NULL, 0);
+
+  len = sizeof(fusd_open_policy_t) + num_uids * sizeof(uid_t) +
+    num_gids * sizeof(gid_t);
+  if ((policy = malloc(len)) == NULL)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  policy->flags = flags;
+  policy->cache_ttl = cache_ttl;
+  policy->num_uids = num_uids;
+  policy->num_gids = num_gids;
+  if (num_uids)
+    memcpy(policy + 1, uids, num_uids * sizeof(uid_t));
+  if (num_gids)
+    memcpy((uid_t *) (policy + 1) + num_uids, gids, num_gids * sizeof(gid_t));
+
+  ret = fusd_send_control(fd, &message, policy, len);
+  free(policy);
+  return ret;
+}
+
+
+int fusd_flush_open_cache(int fd, uid_t uid)
+{
+  fusd_msg_t message;
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_FLUSH_OPEN_CACHE;
+  message.parm.ctl_msg.id = uid;
+
+  return fusd_send_control(fd, &message, NULL, 0);
+}
+
+
+int fusd_set_readiness(int fd, void *file_id, unsigned int state)
+{
+  fusd_msg_t message;
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_SET_READINESS;
+  message.parm.ctl_msg.fusd_file = file_id;
+  message.parm.ctl_msg.set = state;
+  message.parm.ctl_msg.clear = ~state;
+
+  return fusd_send_control(fd, &message, NULL, 0);
+}
+
+
+int fusd_set_file_group(int fd, void *file_id, unsigned int group)
+{
+  fusd_msg_t message;
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_SET_GROUP;
+  message.parm.ctl_msg.fusd_file = file_id;
+  message.parm.ctl_msg.id = group;
+
+  return fusd_send_control(fd, &message, NULL, 0);
+}
+
+
+int fusd_broadcast_readiness(int fd, unsigned int group, unsigned int set,
+                             unsigned int clear)
+{
+  fusd_msg_t message;
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_BROADCAST_READINESS;
+  message.parm.ctl_msg.id = group;
+  message.parm.ctl_msg.set = set;
+  message.parm.ctl_msg.clear = clear;
+
+  return fusd_send_control(fd, &message, NULL, 0);
+}
+
+
+int fusd_set_file_meta(int fd, void *file_id, const fusd_file_meta_t *meta,
+                       unsigned int forget)
+{
+  fusd_msg_t message;
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_SET_FILE_META;
+  message.parm.ctl_msg.fusd_file = file_id;
+  message.parm.ctl_msg.clear = forget;
+
+  return fusd_send_control(fd, &message, meta,
+                           meta == NULL ? 0 : sizeof(fusd_file_meta_t));
+}
+
+
+int fusd_invalidate_cache(int fd, long long offset, long long length)
+{
+  fusd_msg_t message;
+  fusd_cache_range_t range;
+
+  if (offset < 0 || length < 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_INVALIDATE_CACHE;
+  range.offset = offset;
+  range.length = length;
+
+  return fusd_send_control(fd, &message, &range, sizeof(range));
+}
+
+
+int fusd_set_readahead(int fd, unsigned int max_bytes)
+{
+  fusd_msg_t message;
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_SET_READAHEAD;
+  message.parm.ctl_msg.id = max_bytes;
+
+  return fusd_send_control(fd, &message, NULL, 0);
+}
+
+
+int fusd_stream_push(int fd, void *file_id, const void *data, size_t length,
+                     int eof)
+{
+  fusd_msg_t message;
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_STREAM_PUSH;
+  message.parm.ctl_msg.fusd_file = file_id;
+  message.parm.ctl_msg.set = eof ? FUSD_STREAM_EOF : 0;
+
+  return fusd_send_control(fd, &message, data, length);
+}
+
+
+int fusd_set_coalesce_delay(int fd, unsigned int usecs)
+{
+  fusd_msg_t message;
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_SET_COALESCE;
+  message.parm.ctl_msg.id = usecs;
+
+  return fusd_send_control(fd, &message, NULL, 0);
+}
+
+
+int fusd_cache_ioctl(int fd, unsigned int cmd, unsigned int ttl_msecs,
+                     const void *answer, int retval)
+{
+  fusd_msg_t message;
+  fusd_ioctl_cache_t *req;
+  size_t size = sizeof(fusd_ioctl_cache_t);
+  int ret;
+
+  if (answer != NULL)
+    size += _IOC_SIZE(cmd);
+
+  if ((req = malloc(size)) == NULL)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+  req->cmd = cmd;
+  req->ttl = ttl_msecs;
+  req->retval = retval;
+  if (answer != NULL)
+    memcpy(req + 1, answer, _IOC_SIZE(cmd));
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_CACHE_IOCTL;
+
+  ret = fusd_send_control(fd, &message, req, size);
+  free(req);
+  return ret;
+}
+
+
+int fusd_uncache_ioctl(int fd, unsigned int cmd, int forget)
+{
+  fusd_msg_t message;
+
+  memset(&message, 0, sizeof(message));
+  message.subcmd = FUSD_CTL_UNCACHE_IOCTL;
+  message.parm.ctl_msg.id = cmd;
+  message.parm.ctl_msg.set = forget ? FUSD_UNCACHE_FORGET : 0;
+
+  return fusd_send_control(fd, &message, NULL, 0);
+}
+
+
+/* common part of fusd_copy_from_client and fusd_copy_to_client */
+static ssize_t fusd_client_copy(struct fusd_file_info *file, int cmd,
+                                unsigned long client_addr, void *buf,
+                                size_t length)
+{
+  fusd_client_copy_t copy;
+  long ret;
+
+  if (file == NULL || file->fusd_msg == NULL)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  copy.fusd_file = file->fusd_msg->parm.fops_msg.fusd_file;
+  copy.transid = file->fusd_msg->parm.fops_msg.transid;
+  copy.client_addr = client_addr;
+  copy.buf = buf;
+  copy.length = length;
+
+  /* not ioctl(), whose int would truncate copies over 2GB */
+  ret = syscall(SYS_ioctl, file->fd, cmd, &copy);
+  return ret < 0 ? -1 : ret;
+}
+
+
+ssize_t fusd_copy_from_client(struct fusd_file_info *file, void *buf,
+                              const void *client_src, size_t length)
+{
+  return fusd_client_copy(file, FUSD_COPY_FROM_CLIENT,
+                          (unsigned long) client_src, buf, length);
+}
+
+
+ssize_t fusd_copy_to_client(struct fusd_file_info *file, void *client_dst,
+                            const void *buf, size_t length)
+{
+  return fusd_client_copy(file, FUSD_COPY_TO_CLIENT,
+                          (unsigned long) client_dst, (void *) buf, length);
+}
+
+
+int fusd_mmap_fd(struct fusd_file_info *file, int fd, off_t offset)
+{
+  if (file == NULL || file->fusd_msg == NULL ||
+      file->fusd_msg->subcmd != FUSD_MMAP || fd < 0 || offset < 0 ||
+      offset % getpagesize() != 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  file->fusd_msg->parm.fops_msg.mmflags |= FUSD_MMAP_FD;
+  file->fusd_msg->parm.fops_msg.cmd = fd;
+  file->fusd_msg->parm.fops_msg.mmoffset = offset;
+  return 0;
+}
+
+
 /* 
  * fusd_run: a convenience function for automatically running a FUSD
  * driver, for drivers that don't want to manually select on file
@@ -305,15 +693,25 @@ static int fusd_get_message(int fd, fusd_msg_t *msg)
     ret = -errno;
     goto exit;
   }
-  msg->data = NULL; /* pointers in kernelspace have no meaning */
-
   if (msg->magic != FUSD_MSG_MAGIC)
   {
     fprintf(stderr, "libfusd: magic number failure\n");
+    msg->data = NULL;
     ret = -EINVAL;
     goto exit;
   }
 
+  /* small data parts come inline (the kernel leaves the pointer NULL);
+   * pointers in kernelspace have no meaning otherwise */
+  if (msg->datalen > 0 && msg->data == NULL)
+  {
+    msg->data = msg->inline_data;
+    msg->data[msg->datalen] = '\0';
+    ret = 0;
+    goto exit;
+  }
+  msg->data = NULL;
+
   /* if there's a data part to the message, read it from the kernel. */
   if (msg->datalen)
   {
@@ -380,6 +778,131 @@ void fusd_dispatch_fdset(fd_set *set)
 }
 
 
+/*
+ * fusd_batch_op() -- run one op of a FUSD_BATCH message through the
+ * read or ioctl callback, with data the data following it in the
+ * message.  The op gets a file and message of its own, as if it came
+ * alone.  A callback returning -FUSD_NOREPLY keeps them, but the
+ * caller can't wait for it: the op fails with -EAGAIN, and the
+ * eventual fusd_return merely frees them (the message is marked
+ * DROPREPLY).
+ *
+ * Returns what the callback returned, or a negative errno.
+ */
+static int fusd_batch_op(fusd_file_info_t *batch, fusd_file_operations_t *fops,
+                         fusd_batch_op_t *op, char *data)
+{
+  fusd_file_info_t *file;
+  fusd_msg_t *msg;
+  int retval;
+
+  if ((op->op == FUSD_BATCH_READ && fops->read == NULL) ||
+      (op->op == FUSD_BATCH_IOCTL && fops->ioctl == NULL))
+    return -ENOSYS;
+  if (op->op != FUSD_BATCH_READ && op->op != FUSD_BATCH_IOCTL)
+    return -EINVAL;
+
+  if ((msg = malloc(sizeof(fusd_msg_t))) == NULL)
+    return -ENOMEM;
+  memcpy(msg, batch->fusd_msg, sizeof(fusd_msg_t));
+  msg->cmd = FUSD_FOPS_CALL_DROPREPLY;
+  msg->subcmd = op->op == FUSD_BATCH_READ ? FUSD_READ : FUSD_IOCTL;
+  msg->parm.fops_msg.cmd = op->cmd;
+  msg->parm.fops_msg.arg.ptr_arg = op->arg;
+  msg->parm.fops_msg.length = op->length;
+  msg->parm.fops_msg.offset = op->offset;
+  msg->datalen = op->length;
+  msg->data = NULL;
+  if (op->length > FUSD_INLINE_MAX)
+    msg->data = malloc(op->length);
+  else if (op->length > 0)
+    msg->data = msg->inline_data;
+  if (op->length > 0 && msg->data == NULL)
+  {
+    free(msg);
+    return -ENOMEM;
+  }
+  if (op->op == FUSD_BATCH_IOCTL)
+    memcpy(msg->data, data, op->length);
+
+  if ((file = malloc(sizeof(fusd_file_info_t))) == NULL)
+  {
+    if (msg->data != msg->inline_data)
+      free(msg->data);
+    free(msg);
+    return -ENOMEM;
+  }
+  memset(file, '\0', sizeof(fusd_file_info_t));
+  pthread_mutex_init(&file->lock, NULL);
+  file->fd = batch->fd;
+  file->device_info = batch->device_info;
+  file->private_data = batch->private_data;
+  file->flags = batch->flags;
+  file->pid = batch->pid;
+  file->uid = batch->uid;
+  file->gid = batch->gid;
+  file->fusd_msg = msg;
+
+  if (op->op == FUSD_BATCH_READ)
+  {
+    loff_t offset = msg->parm.fops_msg.offset;
+
+    retval = fops->read(file, msg->data, op->length, &offset);
+    msg->parm.fops_msg.offset = offset;
+  }
+  else if (msg->data != NULL)
+    retval = fops->ioctl(file, op->cmd, msg->data);
+  else
+    retval = fops->ioctl(file, op->cmd, op->arg);
+
+  /* the callback kept the file, for a fusd_return we can't wait for */
+  if (retval == -FUSD_NOREPLY)
+    return -EAGAIN;
+
+  if (op->op == FUSD_BATCH_READ && retval > 0)
+    memcpy(data, msg->data, retval = MIN(retval, (int) op->length));
+  else if (op->op == FUSD_BATCH_IOCTL && (_IOC_DIR(op->cmd) & _IOC_READ))
+    memcpy(data, msg->data, op->length);
+
+  /* later ops, and the reply, see what the callback changed */
+  batch->private_data = file->private_data;
+  batch->flags = file->flags;
+  fusd_destroy(file);
+
+  return retval;
+}
+
+
+/*
+ * fusd_run_batch() -- run the ops of a FUSD_BATCH message in order,
+ * leaving their results, and the data they read, in the message,
+ * which goes back to the kernel as it is.
+ */
+static int fusd_run_batch(fusd_file_info_t *file, fusd_file_operations_t *fops,
+                          fusd_msg_t *msg)
+{
+  fusd_batch_op_t *ops = (fusd_batch_op_t *) msg->data;
+  int i, count = msg->parm.fops_msg.length;
+  char *data, *end;
+
+  if (msg->data == NULL || count <= 0 ||
+      count * sizeof(fusd_batch_op_t) > (size_t) msg->datalen)
+    return -EINVAL;
+
+  data = msg->data + count * sizeof(fusd_batch_op_t);
+  end = msg->data + msg->datalen;
+  for (i = 0; i < count; i++)
+  {
+    if (ops[i].length > end - data)
+      return -EINVAL;
+    if (ops[i].op != FUSD_BATCH_DONE)
+      ops[i].result = fusd_batch_op(file, fops, &ops[i], data);
+    data += ops[i].length;
+  }
+  return 0;
+}
+
+
 /* 
  * fusd_dispatch_one() -- read a single kernel-to-userspace message
  * from fd, then call the appropriate userspace callback function,
@@ -463,12 +986,16 @@ static int fusd_dispatch_one(int fd, fusd_file_operations_t *fops)
   {
   case FUSD_OPEN:
     //printf("FUSD_OPEN\n");
+    /* no open callback means every open succeeds; the kernel module
+     * doesn't even ask us in that case */
+    user_retval = 0;
     if (fops && fops->open)
       user_retval = fops->open(file);
     break;
 
   case FUSD_CLOSE:
     //printf("FUSD_CLOSE\n");
+    user_retval = 0;
     if (fops && fops->close)
       user_retval = fops->close(file);
     break;
@@ -519,7 +1046,9 @@ static int fusd_dispatch_one(int fd, fusd_file_operations_t *fops)
            msg->data == NULL)
       {
         msg->datalen = _IOC_SIZE(msg->parm.fops_msg.cmd);
-        if ((msg->data = malloc(msg->datalen)) == NULL)
+        if (msg->datalen <= FUSD_INLINE_MAX)
+          msg->data = msg->inline_data;
+        else if ((msg->data = malloc(msg->datalen)) == NULL)
         {
           user_retval = -ENOMEM;
           break;
@@ -541,6 +1070,31 @@ static int fusd_dispatch_one(int fd, fusd_file_operations_t *fops)
       user_retval = fops->poll_diff(file, msg->parm.fops_msg.cmd);
     break;
 
+  case FUSD_STREAM_LOW:
+    /* the kernel tells us a stream ring has room; no reply wanted */
+    user_retval = 0;
+    if (fops && fops->stream_low)
+      user_retval = fops->stream_low(file, msg->parm.fops_msg.length);
+    break;
+
+  case FUSD_BATCH:
+    user_retval = fusd_run_batch(file, fops, msg);
+    break;
+
+  case FUSD_FAULT:
+    if (fops && fops->fault)
+      user_retval = fops->fault(file, msg->parm.fops_msg.mmoffset, msg->parm.fops_msg.length,
+                                msg->parm.fops_msg.mmprot);
+    break;
+
+  case FUSD_MUNMAP:
+    /* a client mapping is gone; no reply wanted */
+    user_retval = 0;
+    if (fops && fops->munmap)
+      user_retval = fops->munmap(file, msg->parm.fops_msg.mmoffset, msg->parm.fops_msg.length,
+                                 msg->parm.fops_msg.arg.ptr_arg);
+    break;
+
   case FUSD_UNBLOCK:
     //printf("FUSD_UNBLOCK\n");
     /* This callback is called when a system call is interrupted */
@@ -559,7 +1113,7 @@ static int fusd_dispatch_one(int fd, fusd_file_operations_t *fops)
 
   /* out_noreply is only used for handling errors */
 out_noreply:
-  if (msg->data != NULL)
+  if (msg->data != NULL && msg->data != msg->inline_data)
     free(msg->data);
   if (msg != NULL)
     free(msg);
@@ -658,7 +1212,8 @@ void fusd_destroy(struct fusd_file_info *file)
    {
       if (file->fusd_msg->data != NULL)
       {
-         free(file->fusd_msg->data);
+         if (file->fusd_msg->data != file->fusd_msg->inline_data)
+            free(file->fusd_msg->data);
          file->fusd_msg->data = NULL;
       }
       free(file->fusd_msg);
@@ -739,6 +1294,12 @@ int fusd_return(fusd_file_info_t *file, ssize_t retval)
       msg->datalen = 0;
     break;
 
+  case FUSD_BATCH:
+    /* the whole batch goes back, results and data in place */
+    if (retval < 0)
+      msg->datalen = 0;
+    break;
+
   default:
     /* open, close, write, etc. do not return data */
     msg->datalen = 0;
@@ -753,8 +1314,14 @@ int fusd_return(fusd_file_info_t *file, ssize_t retval)
   msg->parm.fops_msg.flags = file->flags;
   /* pid is NOT copied back. */
 
-  /* send message to kernel */
-  if (msg->datalen && msg->data != NULL)
+  /* send message to kernel; small data parts go inline */
+  if (msg->datalen && msg->data != NULL && msg->datalen <= FUSD_INLINE_MAX)
+  {
+    if (msg->data != msg->inline_data)
+      memcpy(msg->inline_data, msg->data, msg->datalen);
+    driver_retval = write(fd, msg, sizeof(fusd_msg_t));
+  }
+  else if (msg->datalen && msg->data != NULL)
   {
     //printf("(msg->datalen [%d] && msg->data != NULL [%p]", msg->datalen, msg->data);
     iov[0].iov_base = msg;